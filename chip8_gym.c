@@ -0,0 +1,128 @@
+//chip8_gym.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "rombuffer.h"
+#include "cpu.h"
+#include "gym.h"
+
+#define DEFAULT_ENVS 16
+#define DEFAULT_IPS 700
+#define USAGE "Usage: %s [-n envs] [-i ips] [-s seed] [-t | -j] " \
+              "[-m address,...] shm_name rom\n"
+
+static gym_header_t *served = NULL;
+
+static void handle_quit(int signal_number);
+static int parse_peeks(char *list, gym_config_t *config);
+
+int main(int argc, char *argv[]) {
+    int opt;
+    gym_config_t config = {
+        .env_count = DEFAULT_ENVS,
+        .ips = DEFAULT_IPS,
+        .engine = CPU_ENGINE_INTERPRETER,
+        .seed = 0,
+        .peek_count = 0
+    };
+    while ((opt = getopt(argc, argv, "n:i:s:tjm:")) != -1) {
+        if (opt == 'n') {
+            unsigned long envs = strtoul(optarg, NULL, 10);
+            config.env_count = envs > UINT32_MAX ? 0 : envs;
+        } else if (opt == 'i') {
+            unsigned long ips = strtoul(optarg, NULL, 10);
+            config.ips = ips > UINT32_MAX ? 0 : ips;
+        } else if (opt == 's') {
+            config.seed = strtoull(optarg, NULL, 0);
+        } else if (opt == 't') {
+            config.engine = CPU_ENGINE_THREADED;
+        } else if (opt == 'j') {
+            config.engine = CPU_ENGINE_JIT;
+        } else if (opt == 'm') {
+            if (parse_peeks(optarg, &config)) {
+                fprintf(stderr, "Error: at most %d addresses below 0x1000\n",
+                        GYM_MAX_PEEKS);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind + 1 >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.env_count == 0 || config.ips == 0) {
+        fprintf(stderr, "Error: envs and ips must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *rom = fopen(argv[optind + 1], "r");
+    if (rom == NULL) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    rombuffer_t *rom_opcodes = rombuffer_read(rom);
+    if (rom_opcodes == NULL) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+    fclose(rom);
+
+    gym_t *gym = gym_new(rom_opcodes, &config, argv[optind]);
+    if (gym == NULL) {
+        fprintf(stderr, "Error: unable to create shared memory %s\n",
+                argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    //a signal closes the gym like an agent would, so the shared memory
+    //object is still unlinked
+    served = gym_get_header(gym);
+    signal(SIGINT, handle_quit);
+    signal(SIGTERM, handle_quit);
+
+    printf("serving %u envs on %s, %zu bytes\n", config.env_count,
+           argv[optind], gym_get_size(gym));
+    fflush(stdout);
+
+    gym_serve(gym);
+
+    gym_free(gym);
+    rombuffer_free(rom_opcodes);
+
+    return 0;
+}
+
+static void handle_quit(int signal_number) {
+    (void)signal_number;
+    atomic_store(&served->closed, 1);
+}
+
+//comma separated memory addresses, in any base strtoul reads
+static int parse_peeks(char *list, gym_config_t *config) {
+    for (char *token = strtok(list, ","); token != NULL;
+         token = strtok(NULL, ","))
+    {
+        char *end;
+        unsigned long address = strtoul(token, &end, 0);
+        if (*end != '\0' || address > 0xFFF ||
+            config->peek_count == GYM_MAX_PEEKS)
+        {
+            return -1;
+        }
+
+        config->peek_addresses[config->peek_count++] = address;
+    }
+
+    return 0;
+}
@@ -0,0 +1,372 @@
+//chip8_headless.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "rombuffer.h"
+#include "disassembler.h"
+#include "cpu.h"
+#include "cpu_soa.h"
+#include "null_io.h"
+#include "replay_io.h"
+#include "headless.h"
+
+#define DEFAULT_IPS 700
+#define DEFAULT_FRAMES 600
+#define CHECK_FRAMES 60
+#define USAGE "Usage: %s [-f frames] [-n instructions] [-i ips] [-t | -j] " \
+              "[-k keyscript | -p play] [-s seed] [-l lanes [-v]] rom\n" \
+              "       %s -c\n"
+
+//roms the lanes once got wrong, run by -c
+static const uint16_t check_pc_wrap_jump[] = {
+    0x60FF,                             //LD V0, 0xFF
+    0xBFFF                              //JP V0, 0xFFF: pc 0x10FE
+};
+static const uint16_t check_pc_wrap_skip[] = {
+    0x6040,                             //LD V0, 0x40
+    0x6100,                             //LD V1, 0x00
+    0xAFFE,                             //LD I, 0xFFE
+    0xF155,                             //LD [I], V1: SNE V0, 0x00 at 0xFFE
+    0x1FFE                              //JP 0xFFE, which skips to 0x1002
+};
+static const rombuffer_t check_roms[] = {
+    {(uint16_t *)check_pc_wrap_jump,
+     sizeof(check_pc_wrap_jump) / sizeof(uint16_t)},
+    {(uint16_t *)check_pc_wrap_skip,
+     sizeof(check_pc_wrap_skip) / sizeof(uint16_t)}
+};
+
+static null_io_event_t *read_key_script(const char *path, size_t *length);
+static int run_lanes(const rombuffer_t *rom, uint32_t lane_count,
+                     uint64_t seed, const null_io_event_t *script,
+                     size_t script_length, const headless_config_t *config,
+                     bool verify, bool quiet);
+static int run_checks(const headless_config_t *config);
+
+int main(int argc, char *argv[]) {
+    int opt;
+    headless_config_t config = {
+        .ips = DEFAULT_IPS,
+        .max_frames = 0,
+        .max_instructions = 0
+    };
+    cpu_engine_t engine = CPU_ENGINE_INTERPRETER;
+    const char *script_path = NULL;
+    const char *play_path = NULL;
+    uint64_t seed = 0;
+    uint32_t lane_count = 0;
+    bool verify = false;
+    bool check = false;
+    while ((opt = getopt(argc, argv, "f:n:i:tjk:p:s:l:vc")) != -1) {
+        if (opt == 'f') {
+            config.max_frames = strtoull(optarg, NULL, 10);
+        } else if (opt == 'n') {
+            config.max_instructions = strtoull(optarg, NULL, 10);
+        } else if (opt == 'i') {
+            unsigned long ips = strtoul(optarg, NULL, 10);
+            config.ips = ips > UINT32_MAX ? 0 : ips;
+        } else if (opt == 't') {
+            engine = CPU_ENGINE_THREADED;
+        } else if (opt == 'j') {
+            engine = CPU_ENGINE_JIT;
+        } else if (opt == 'k') {
+            script_path = optarg;
+        } else if (opt == 'p') {
+            play_path = optarg;
+        } else if (opt == 's') {
+            seed = strtoull(optarg, NULL, 0);
+        } else if (opt == 'l') {
+            unsigned long lanes = strtoul(optarg, NULL, 10);
+            lane_count = lanes > CPU_SOA_MAX_LANES ? 0 : lanes;
+            if (lane_count == 0) {
+                fprintf(stderr, "Error: lanes must be 1 to %d\n",
+                        CPU_SOA_MAX_LANES);
+                exit(EXIT_FAILURE);
+            }
+        } else if (opt == 'v') {
+            verify = true;
+        } else if (opt == 'c') {
+            check = true;
+        } else {
+            fprintf(stderr, USAGE, argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (check) {
+        config.max_frames = CHECK_FRAMES;
+        exit(run_checks(&config) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    //lanes run the interpreter and cannot replay a recording, which needs
+    //a cpu_t to count instructions on
+    if (optind >= argc || (script_path != NULL && play_path != NULL) ||
+        (lane_count > 0 && play_path != NULL) ||
+        (verify && lane_count == 0))
+    {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *rom = fopen(argv[optind], "r");
+    if (rom == NULL) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    rombuffer_t *rom_opcodes = rombuffer_read(rom);
+    if (rom_opcodes == NULL) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+    fclose(rom);
+
+    size_t script_length = 0;
+    null_io_event_t *script = NULL;
+    if (script_path != NULL) {
+        script = read_key_script(script_path, &script_length);
+        if (script == NULL) {
+            fprintf(stderr, "Error: unable to read key script %s\n",
+                    script_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    null_io_t *null_io = null_io_new();
+    if (null_io == NULL) {
+        fprintf(stderr, "Error: unable to initialize io\n");
+        exit(EXIT_FAILURE);
+    }
+    null_io_set_script(null_io, script, script_length);
+
+    //a replay runs the recorded trace to its end at the recorded speed
+    replay_io_t *replay_io = NULL;
+    if (play_path != NULL) {
+        replay_io = replay_io_new_player(play_path, &null_io_interface,
+                                         null_io, rom_opcodes);
+        if (replay_io == NULL) {
+            fprintf(stderr, "Error: unable to read input log %s\n",
+                    play_path);
+            exit(EXIT_FAILURE);
+        }
+
+        seed = replay_io_get_seed(replay_io);
+        config.ips = replay_io_get_ips(replay_io);
+        if (config.max_frames == 0 && config.max_instructions == 0) {
+            config.max_instructions =
+                replay_io_get_instruction_count(replay_io);
+        }
+    }
+
+    if (config.max_frames == 0 && config.max_instructions == 0) {
+        config.max_frames = DEFAULT_FRAMES;
+    }
+
+    if (lane_count > 0) {
+        int error_code = run_lanes(rom_opcodes, lane_count, seed, script,
+                                   script_length, &config, verify, false);
+        null_io_free(null_io);
+        free(script);
+        rombuffer_free(rom_opcodes);
+
+        exit(error_code ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    cpu_t *cpu = replay_io != NULL ?
+                 cpu_new(&replay_io_interface, replay_io) :
+                 cpu_new(&null_io_interface, null_io);
+    if (cpu == NULL) {
+        fprintf(stderr, "Error: unable to initialize CPU\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cpu_set_engine(cpu, engine)) {
+        fprintf(stderr, "Error: unable to select CPU engine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_set_seed(cpu, seed);
+    if (cpu_load(cpu, rom_opcodes)) {
+        fprintf(stderr, "Error: unable to load ROM\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replay_io != NULL) {
+        replay_io_set_cpu(replay_io, cpu);
+    }
+
+    headless_result_t result;
+    headless_run(cpu, null_io, &config, &result);
+
+    printf("hash: %016llx\n", (unsigned long long)result.display_hash);
+    printf("instructions: %llu\n", (unsigned long long)result.instructions);
+    printf("frames: %llu\n", (unsigned long long)result.frames);
+    printf("seconds: %.6f\n", result.seconds);
+    if (result.seconds > 0) {
+        printf("mips: %.2f\n", result.instructions / result.seconds / 1e6);
+    }
+
+    replay_io_free(replay_io);
+    cpu_free(cpu);
+    null_io_free(null_io);
+    free(script);
+    rombuffer_free(rom_opcodes);
+
+    if (result.error_code) {
+        fprintf(stderr, "CPU error: %d\n", result.error_code);
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+//reads "frame keys" pairs, one per line, keys being the 16-bit mask held
+//from that frame on. numbers may be decimal or 0x prefixed hex
+static null_io_event_t *read_key_script(const char *path, size_t *length) {
+    FILE *script_f = fopen(path, "r");
+    if (script_f == NULL) {
+        return NULL;
+    }
+
+    size_t capacity = 16;
+    null_io_event_t *events = malloc(capacity * sizeof(null_io_event_t));
+    if (events == NULL) {
+        fclose(script_f);
+        return NULL;
+    }
+
+    *length = 0;
+    long long frame;
+    int keys;
+    while (fscanf(script_f, "%lli %i", &frame, &keys) == 2) {
+        if (*length == capacity) {
+            capacity *= 2;
+            null_io_event_t *grown = realloc(events,
+                                             capacity * sizeof(null_io_event_t));
+            if (grown == NULL) {
+                free(events);
+                fclose(script_f);
+                return NULL;
+            }
+            events = grown;
+        }
+
+        events[*length].frame = frame;
+        events[*length].keys = keys;
+        (*length)++;
+    }
+
+    fclose(script_f);
+
+    return events;
+}
+
+//runs rom on lane_count lanes seeded from seed on, and with verify replays
+//every lane on a cpu_t for comparison. returns 1 on a mismatch, -1 when
+//something could not be set up
+static int run_lanes(const rombuffer_t *rom, uint32_t lane_count,
+                     uint64_t seed, const null_io_event_t *script,
+                     size_t script_length, const headless_config_t *config,
+                     bool verify, bool quiet) {
+    cpu_soa_t *cpu_soa = cpu_soa_new(lane_count);
+    null_io_t *null_io = null_io_new();
+    if (cpu_soa == NULL || null_io == NULL) {
+        fprintf(stderr, "Error: unable to initialize lanes\n");
+        cpu_soa_free(cpu_soa);
+        null_io_free(null_io);
+        return -1;
+    }
+
+    for (uint32_t lane = 0; lane < lane_count; lane++) {
+        cpu_soa_set_seed(cpu_soa, lane, seed + lane);
+    }
+    cpu_soa_load(cpu_soa, rom);
+    null_io_set_script(null_io, script, script_length);
+
+    headless_result_t result;
+    headless_run_lanes(cpu_soa, lane_count, null_io, config, &result);
+
+    if (!quiet) {
+        printf("hash: %016llx\n", (unsigned long long)result.display_hash);
+        printf("instructions: %llu\n",
+               (unsigned long long)result.instructions);
+        printf("frames: %llu\n", (unsigned long long)result.frames);
+        printf("seconds: %.6f\n", result.seconds);
+        if (result.seconds > 0) {
+            printf("mips: %.2f\n",
+                   result.instructions / result.seconds / 1e6);
+        }
+    }
+
+    //each lane against a cpu_t on the interpreter, timed as the baseline
+    int mismatch = 0;
+    uint64_t scalar_instructions = 0;
+    double scalar_seconds = 0;
+    for (uint32_t lane = 0; verify && lane < lane_count; lane++) {
+        null_io_t *lane_io = null_io_new();
+        cpu_t *cpu = cpu_new(&null_io_interface, lane_io);
+        if (lane_io == NULL || cpu == NULL) {
+            fprintf(stderr, "Error: unable to initialize CPU\n");
+            cpu_free(cpu);
+            null_io_free(lane_io);
+            mismatch = -1;
+            break;
+        }
+
+        null_io_set_script(lane_io, script, script_length);
+        cpu_set_seed(cpu, seed + lane);
+        if (cpu_load(cpu, rom)) {
+            fprintf(stderr, "Error: unable to load ROM\n");
+            cpu_free(cpu);
+            null_io_free(lane_io);
+            mismatch = -1;
+            break;
+        }
+
+        headless_result_t scalar;
+        if (headless_check_lane(cpu_soa, lane, cpu, lane_io, config,
+                                result.frames, &scalar))
+        {
+            fprintf(stderr, "lane %u differs from the cpu in error code "
+                    "(%d, %d), instructions (%llu, %llu) or display\n",
+                    lane, cpu_soa_get_error(cpu_soa, lane),
+                    scalar.error_code,
+                    (unsigned long long)
+                    cpu_soa_get_instruction_count(cpu_soa, lane),
+                    (unsigned long long)scalar.instructions);
+            mismatch = 1;
+        }
+        scalar_instructions += scalar.instructions;
+        scalar_seconds += scalar.seconds;
+
+        cpu_free(cpu);
+        null_io_free(lane_io);
+    }
+
+    if (verify && !quiet && mismatch == 0) {
+        printf("verified: %u lanes\n", lane_count);
+        if (scalar_seconds > 0) {
+            printf("scalar mips: %.2f\n",
+                   scalar_instructions / scalar_seconds / 1e6);
+        }
+    }
+
+    cpu_soa_free(cpu_soa);
+    null_io_free(null_io);
+
+    return mismatch;
+}
+
+//runs the check roms on every lane against cpu_t, reporting each
+static int run_checks(const headless_config_t *config) {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(check_roms) / sizeof(rombuffer_t); i++) {
+        int error_code = run_lanes(&check_roms[i], CPU_SOA_MAX_LANES, 0, NULL,
+                                   0, config, true, true);
+        printf("check %zu: %s\n", i, error_code ? "FAILED" : "ok");
+        failed |= error_code != 0;
+    }
+
+    return failed;
+}
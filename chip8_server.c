@@ -0,0 +1,729 @@
+//chip8_server.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "rombuffer.h"
+#include "disassembler.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "work_deque.h"
+
+#define DEFAULT_IPS 700
+#define DEFAULT_MAX_SESSIONS 4096
+#define MAX_CLIENTS 64
+#define LINE_LENGTH 512
+#define REPLY_LENGTH 1024
+#define NS_PER_SECOND 1000000000ULL
+#define FRAME_NS (NS_PER_SECOND / SCHEDULER_TIMER_HZ)
+#define MAX_LAG_NS (4 * FRAME_NS)
+#define USAGE "Usage: %s [-w workers] [-i ips] [-n max_sessions] [-t | -j] " \
+              "[-T] socket\n"
+
+//one emulated machine. keys are written by the server thread, everything
+//the cpu touches only by the worker running its slice
+typedef struct session {
+    uint32_t id;
+    cpu_t *cpu;
+    uint32_t cycle_remainder;
+    uint16_t press_keys;                //keys held during the slice
+    struct session *next;               //in the home worker's list
+
+    atomic_int error_code;
+    atomic_uint keys;
+    atomic_bool busy;                   //queued or running a slice
+    atomic_bool closed;                 //freed by the home worker
+    atomic_bool parked;                 //waiting for a key press
+    atomic_uint_fast64_t frames;
+
+    pthread_mutex_t mutex_display;
+    uint64_t display[DISPLAY_HEIGHT];
+
+    //frame rate sampled by the server thread
+    uint64_t sampled_frames;
+    double fps;
+} session_t;
+
+typedef struct worker {
+    pthread_t thread;
+    struct server *server;
+    work_deque_t *deque;
+
+    pthread_mutex_t mutex_sessions;
+    session_t *sessions;                //home sessions, queued every frame
+    size_t session_count;
+
+    atomic_uint_fast64_t steals;
+} worker_t;
+
+typedef struct server_client {
+    int fd;
+    char line[LINE_LENGTH];
+    size_t length;
+} server_client_t;
+
+typedef struct server {
+    worker_t *workers;
+    size_t worker_count;
+    uint32_t ips;
+    bool turbo;
+    cpu_engine_t engine;
+    uint64_t epoch;
+    atomic_bool quit;
+
+    //server thread only
+    session_t **sessions;               //indexed by id, max_sessions long
+    size_t max_sessions;
+    size_t session_count;
+    server_client_t clients[MAX_CLIENTS];
+    size_t client_count;
+    uint64_t sampled;
+} server_t;
+
+static uint16_t server_get_keyboard(void *context);
+static uint8_t server_wait_keypress(void *context);
+static void server_present_frame(void *context,
+                                 const uint64_t display[DISPLAY_HEIGHT],
+                                 uint32_t dirty_rows);
+static void *server_worker(void *worker);
+static void server_queue_sessions(worker_t *worker);
+static session_t *server_steal(worker_t *worker);
+static void server_run_slice(const server_t *server, session_t *session);
+static int server_listen(const char *path);
+static void server_accept(server_t *server, int listen_fd);
+static bool server_read_client(server_t *server, server_client_t *client);
+static bool server_command(server_t *server, int fd, char *line);
+static int server_load(server_t *server, const char *path, uint64_t seed);
+static session_t *server_find(const server_t *server, const char *id);
+static void server_sample(server_t *server);
+static void server_reply(int fd, const char *format, ...);
+static void session_free(session_t *session);
+static uint64_t server_now();
+
+static const cpu_io_interface_t server_io_interface = {
+    .get_keyboard = server_get_keyboard,
+    .wait_keypress = server_wait_keypress,
+    .present_frame = server_present_frame
+};
+
+int main(int argc, char *argv[]) {
+    int opt;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    server_t server = {
+        .ips = DEFAULT_IPS,
+        .turbo = false,
+        .engine = CPU_ENGINE_INTERPRETER,
+        .max_sessions = DEFAULT_MAX_SESSIONS
+    };
+    while ((opt = getopt(argc, argv, "w:i:n:tjT")) != -1) {
+        if (opt == 'w') {
+            workers = strtol(optarg, NULL, 10);
+        } else if (opt == 'i') {
+            unsigned long ips = strtoul(optarg, NULL, 10);
+            server.ips = ips > UINT32_MAX ? 0 : ips;
+        } else if (opt == 'n') {
+            server.max_sessions = strtoul(optarg, NULL, 10);
+        } else if (opt == 't') {
+            server.engine = CPU_ENGINE_THREADED;
+        } else if (opt == 'j') {
+            server.engine = CPU_ENGINE_JIT;
+        } else if (opt == 'T') {
+            server.turbo = true;
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (server.ips == 0 || server.max_sessions == 0) {
+        fprintf(stderr, "Error: ips and max_sessions must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    server.sessions = calloc(server.max_sessions, sizeof(session_t *));
+    server.workers = calloc(workers, sizeof(worker_t));
+    if (server.sessions == NULL || server.workers == NULL) {
+        fprintf(stderr, "Error: unable to allocate sessions\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *socket_path = argv[optind];
+    int listen_fd = server_listen(socket_path);
+    if (listen_fd < 0) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&server.quit, false);
+    server.epoch = server_now();
+    server.sampled = server.epoch;
+
+    //every deque can hold every session, so pushes never fail
+    for (long i = 0; i < workers; i++) {
+        worker_t *worker = &server.workers[i];
+        worker->server = &server;
+        worker->deque = work_deque_new(server.max_sessions);
+        pthread_mutex_init(&worker->mutex_sessions, NULL);
+        atomic_init(&worker->steals, 0);
+        if (worker->deque == NULL) {
+            fprintf(stderr, "Error: unable to allocate work queues\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //thieves walk every worker, so all of them have to start
+    server.worker_count = workers;
+    for (long i = 0; i < workers; i++) {
+        int ret = pthread_create(&server.workers[i].thread, NULL,
+                                 server_worker, &server.workers[i]);
+        if (ret) {
+            fprintf(stderr, "error: pthread_create() returns: %d\n", ret);
+            unlink(socket_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(stderr, "listening on %s with %zu workers\n", socket_path,
+            server.worker_count);
+
+    //the calling thread serves the socket and samples the frame rates
+    while (!atomic_load(&server.quit)) {
+        struct pollfd fds[MAX_CLIENTS + 1];
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < server.client_count; i++) {
+            fds[i + 1].fd = server.clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        if (poll(fds, server.client_count + 1, 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: ");
+            break;
+        }
+
+        //a client is dropped by moving the last one into its place, so
+        //walk backwards to keep fds and clients lined up
+        for (size_t i = server.client_count; i > 0; i--) {
+            if (fds[i].revents && !server_read_client(&server,
+                                                      &server.clients[i - 1]))
+            {
+                close(server.clients[i - 1].fd);
+                server.clients[i - 1] = server.clients[--server.client_count];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            server_accept(&server, listen_fd);
+        }
+
+        if (server_now() - server.sampled >= NS_PER_SECOND) {
+            server_sample(&server);
+        }
+    }
+
+    atomic_store(&server.quit, true);
+    for (size_t i = 0; i < server.worker_count; i++) {
+        pthread_join(server.workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < server.client_count; i++) {
+        close(server.clients[i].fd);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+
+    //every session, closed or not, is still in its home worker's list
+    for (long i = 0; i < workers; i++) {
+        worker_t *worker = &server.workers[i];
+        while (worker->sessions != NULL) {
+            session_t *session = worker->sessions;
+            worker->sessions = session->next;
+            session_free(session);
+        }
+        work_deque_free(worker->deque);
+        pthread_mutex_destroy(&worker->mutex_sessions);
+    }
+    free(server.workers);
+    free(server.sessions);
+
+    exit(EXIT_SUCCESS);
+}
+
+static uint16_t server_get_keyboard(void *context) {
+    return atomic_load(&((session_t *)context)->keys);
+}
+
+//only reached with keys held, see server_run_slice
+static uint8_t server_wait_keypress(void *context) {
+    return scheduler_lowest_key(((session_t *)context)->press_keys);
+}
+
+static void server_present_frame(void *context,
+                                 const uint64_t display[DISPLAY_HEIGHT],
+                                 uint32_t dirty_rows) {
+    session_t *session = context;
+
+    pthread_mutex_lock(&session->mutex_display);
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (dirty_rows & (1u << y)) {
+            session->display[y] = display[y];
+        }
+    }
+    pthread_mutex_unlock(&session->mutex_display);
+}
+
+//every frame a worker queues its home sessions on its own deque, then runs
+//slices from the bottom of it. once it is empty the worker steals from the
+//top of the others', so the load evens out whatever the sessions cost
+static void *server_worker(void *worker) {
+    worker_t *self = worker;
+    server_t *server = self->server;
+
+    uint64_t frame = 0;
+    while (!atomic_load(&server->quit)) {
+        frame++;
+        if (!server->turbo) {
+            uint64_t deadline = server->epoch + frame * FRAME_NS;
+            uint64_t now = server_now();
+            if (now > deadline + MAX_LAG_NS) {
+                frame = (now - server->epoch) / FRAME_NS;
+                deadline = server->epoch + frame * FRAME_NS;
+            }
+
+            struct timespec target = {
+                .tv_sec = deadline / NS_PER_SECOND,
+                .tv_nsec = deadline % NS_PER_SECOND
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target,
+                                   NULL) == EINTR);
+        }
+
+        server_queue_sessions(self);
+
+        session_t *session;
+        while ((session = work_deque_pop(self->deque)) != NULL ||
+               (session = server_steal(self)) != NULL)
+        {
+            server_run_slice(server, session);
+        }
+    }
+
+    return NULL;
+}
+
+//frees closed sessions and pushes the rest. a session still busy from the
+//previous frame drops this one, a parked one only has its timers ticked
+static void server_queue_sessions(worker_t *worker) {
+    pthread_mutex_lock(&worker->mutex_sessions);
+
+    session_t **link = &worker->sessions;
+    while (*link != NULL) {
+        session_t *session = *link;
+
+        if (atomic_load(&session->closed) && !atomic_load(&session->busy)) {
+            *link = session->next;
+            worker->session_count--;
+            session_free(session);
+            continue;
+        }
+        link = &session->next;
+
+        if (atomic_load(&session->error_code) ||
+            atomic_load(&session->closed) ||
+            atomic_exchange(&session->busy, true))
+        {
+            continue;
+        }
+
+        if (cpu_key_wait_pending(session->cpu) &&
+            atomic_load(&session->keys) == 0)
+        {
+            atomic_store(&session->parked, true);
+            atomic_store(&session->error_code,
+                         cpu_decrement_timers(session->cpu));
+            atomic_fetch_add(&session->frames, 1);
+            atomic_store(&session->busy, false);
+            continue;
+        }
+
+        atomic_store(&session->parked, false);
+        if (work_deque_push(worker->deque, session)) {
+            atomic_store(&session->busy, false);
+        }
+    }
+
+    pthread_mutex_unlock(&worker->mutex_sessions);
+}
+
+static session_t *server_steal(worker_t *worker) {
+    server_t *server = worker->server;
+    size_t index = worker - server->workers;
+
+    for (size_t i = 1; i < server->worker_count; i++) {
+        worker_t *victim = &server->workers[(index + i) %
+                                            server->worker_count];
+        session_t *session = work_deque_steal(victim->deque);
+        if (session != NULL) {
+            atomic_fetch_add_explicit(&worker->steals, 1,
+                                      memory_order_relaxed);
+            return session;
+        }
+    }
+
+    return NULL;
+}
+
+//runs one frame of a session with the keys sampled once for the whole
+//slice, see scheduler_step_frame
+static void server_run_slice(const server_t *server, session_t *session) {
+    session->press_keys = atomic_load(&session->keys);
+    int error_code = scheduler_step_frame(session->cpu, server->ips,
+                                          &session->cycle_remainder,
+                                          session->press_keys);
+
+    atomic_store(&session->error_code, error_code);
+    atomic_fetch_add(&session->frames, 1);
+    atomic_store(&session->busy, false);
+}
+
+static int server_listen(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) ||
+        listen(fd, MAX_CLIENTS))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void server_accept(server_t *server, int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    if (server->client_count == MAX_CLIENTS) {
+        server_reply(fd, "error too many clients\n");
+        close(fd);
+        return;
+    }
+
+    server_client_t *client = &server->clients[server->client_count++];
+    client->fd = fd;
+    client->length = 0;
+}
+
+//false once the client is gone or asked to leave
+static bool server_read_client(server_t *server, server_client_t *client) {
+    ssize_t received = read(client->fd, client->line + client->length,
+                            LINE_LENGTH - client->length);
+    if (received <= 0) {
+        return false;
+    }
+    client->length += received;
+
+    char *start = client->line;
+    char *end;
+    while ((end = memchr(start, '\n', client->length -
+                                      (start - client->line))) != NULL)
+    {
+        *end = '\0';
+        if (!server_command(server, client->fd, start)) {
+            return false;
+        }
+        start = end + 1;
+    }
+
+    client->length -= start - client->line;
+    memmove(client->line, start, client->length);
+
+    if (client->length == LINE_LENGTH) {
+        server_reply(client->fd, "error line too long\n");
+        client->length = 0;
+    }
+
+    return true;
+}
+
+//handles one request line, see the protocol at the end of the file.
+//false ends the connection
+static bool server_command(server_t *server, int fd, char *line) {
+    char *save;
+    const char *command = strtok_r(line, " \t\r", &save);
+    const char *argument = strtok_r(NULL, " \t\r", &save);
+    const char *value = strtok_r(NULL, " \t\r", &save);
+
+    if (command == NULL) {
+        return true;
+    }
+
+    if (!strcmp(command, "load") && argument != NULL) {
+        int id = server_load(server, argument,
+                             value != NULL ? strtoull(value, NULL, 0) : 0);
+        if (id < 0) {
+            server_reply(fd, "error unable to load %s\n", argument);
+        } else {
+            server_reply(fd, "ok %d\n", id);
+        }
+        return true;
+    }
+
+    if (!strcmp(command, "stats") && argument == NULL) {
+        uint64_t frames = 0;
+        double fps = 0;
+        for (size_t i = 0; i < server->max_sessions; i++) {
+            if (server->sessions[i] != NULL) {
+                frames += atomic_load(&server->sessions[i]->frames);
+                fps += server->sessions[i]->fps;
+            }
+        }
+
+        uint64_t steals = 0;
+        for (size_t i = 0; i < server->worker_count; i++) {
+            steals += atomic_load(&server->workers[i].steals);
+        }
+
+        server_reply(fd, "ok sessions %zu frames %llu fps %.1f steals %llu\n",
+                     server->session_count, (unsigned long long)frames, fps,
+                     (unsigned long long)steals);
+        return true;
+    }
+
+    if (!strcmp(command, "quit")) {
+        server_reply(fd, "ok\n");
+        return false;
+    }
+
+    if (!strcmp(command, "shutdown")) {
+        server_reply(fd, "ok\n");
+        atomic_store(&server->quit, true);
+        return true;
+    }
+
+    if (strcmp(command, "keys") && strcmp(command, "display") &&
+        strcmp(command, "stats") && strcmp(command, "close"))
+    {
+        server_reply(fd, "error unknown command\n");
+        return true;
+    }
+
+    session_t *session = server_find(server, argument);
+    if (session == NULL) {
+        server_reply(fd, "error no such session\n");
+        return true;
+    }
+
+    if (!strcmp(command, "keys") && value != NULL) {
+        atomic_store(&session->keys, strtoul(value, NULL, 0) & 0xFFFF);
+        server_reply(fd, "ok\n");
+    } else if (!strcmp(command, "display")) {
+        char reply[REPLY_LENGTH] = "ok";
+        size_t length = 2;
+
+        pthread_mutex_lock(&session->mutex_display);
+        for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+            length += sprintf(reply + length, " %016llx",
+                              (unsigned long long)session->display[y]);
+        }
+        pthread_mutex_unlock(&session->mutex_display);
+
+        server_reply(fd, "%s\n", reply);
+    } else if (!strcmp(command, "stats")) {
+        server_reply(fd, "ok frames %llu fps %.1f parked %d error %d\n",
+                     (unsigned long long)atomic_load(&session->frames),
+                     session->fps, atomic_load(&session->parked),
+                     atomic_load(&session->error_code));
+    } else if (!strcmp(command, "close")) {
+        server->sessions[session->id] = NULL;
+        server->session_count--;
+        atomic_store(&session->closed, true);
+        server_reply(fd, "ok\n");
+    } else {
+        server_reply(fd, "error missing key mask\n");
+    }
+
+    return true;
+}
+
+//creates a session on the worker with the fewest, returns its id
+static int server_load(server_t *server, const char *path, uint64_t seed) {
+    size_t id = 0;
+    while (id < server->max_sessions && server->sessions[id] != NULL) {
+        id++;
+    }
+    if (id == server->max_sessions) {
+        return -1;
+    }
+
+    FILE *rom = fopen(path, "r");
+    if (rom == NULL) {
+        return -1;
+    }
+
+    rombuffer_t *rom_opcodes = rombuffer_read(rom);
+    fclose(rom);
+    if (rom_opcodes == NULL) {
+        return -1;
+    }
+
+    session_t *session = calloc(1, sizeof(session_t));
+    if (session == NULL) {
+        rombuffer_free(rom_opcodes);
+        return -1;
+    }
+
+    session->id = id;
+    atomic_init(&session->error_code, 0);
+    atomic_init(&session->keys, 0);
+    atomic_init(&session->busy, false);
+    atomic_init(&session->closed, false);
+    atomic_init(&session->parked, false);
+    atomic_init(&session->frames, 0);
+    pthread_mutex_init(&session->mutex_display, NULL);
+
+    session->cpu = cpu_new(&server_io_interface, session);
+    if (session->cpu == NULL || cpu_set_engine(session->cpu, server->engine)) {
+        session_free(session);
+        rombuffer_free(rom_opcodes);
+        return -1;
+    }
+
+    cpu_set_seed(session->cpu, seed);
+    int error_code = cpu_load(session->cpu, rom_opcodes);
+    rombuffer_free(rom_opcodes);
+    if (error_code) {
+        session_free(session);
+        return -1;
+    }
+
+    worker_t *home = NULL;
+    size_t fewest = SIZE_MAX;
+    for (size_t i = 0; i < server->worker_count; i++) {
+        worker_t *worker = &server->workers[i];
+        pthread_mutex_lock(&worker->mutex_sessions);
+        if (worker->session_count < fewest) {
+            fewest = worker->session_count;
+            home = worker;
+        }
+        pthread_mutex_unlock(&worker->mutex_sessions);
+    }
+
+    pthread_mutex_lock(&home->mutex_sessions);
+    session->next = home->sessions;
+    home->sessions = session;
+    home->session_count++;
+    pthread_mutex_unlock(&home->mutex_sessions);
+
+    server->sessions[id] = session;
+    server->session_count++;
+
+    return id;
+}
+
+static session_t *server_find(const server_t *server, const char *id) {
+    if (id == NULL) {
+        return NULL;
+    }
+
+    char *end;
+    unsigned long index = strtoul(id, &end, 10);
+    if (*end != '\0' || index >= server->max_sessions) {
+        return NULL;
+    }
+
+    return server->sessions[index];
+}
+
+//frames per second of every session since the previous sample
+static void server_sample(server_t *server) {
+    uint64_t now = server_now();
+    double seconds = (double)(now - server->sampled) / NS_PER_SECOND;
+    server->sampled = now;
+
+    for (size_t i = 0; i < server->max_sessions; i++) {
+        session_t *session = server->sessions[i];
+        if (session == NULL) {
+            continue;
+        }
+
+        uint64_t frames = atomic_load(&session->frames);
+        session->fps = (frames - session->sampled_frames) / seconds;
+        session->sampled_frames = frames;
+    }
+}
+
+static void server_reply(int fd, const char *format, ...) {
+    char reply[REPLY_LENGTH];
+
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(reply, sizeof(reply), format, arguments);
+    va_end(arguments);
+
+    if (length > 0) {
+        send(fd, reply, (size_t)length < sizeof(reply) ? (size_t)length
+                                                       : sizeof(reply) - 1,
+             MSG_NOSIGNAL);
+    }
+}
+
+static void session_free(session_t *session) {
+    cpu_free(session->cpu);
+    pthread_mutex_destroy(&session->mutex_display);
+    free(session);
+}
+
+static uint64_t server_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+//protocol, one request per line over the unix socket, one reply line each:
+//  load <rom path> [seed]      ok <id>
+//  keys <id> <mask>            ok, mask as for get_keyboard
+//  display <id>                ok and 32 rows of 16 hex digits, bit 63 x = 0
+//  stats <id>                  ok frames <n> fps <f> parked <0|1> error <e>
+//  stats                       ok sessions <n> frames <n> fps <f> steals <n>
+//  close <id>                  ok, the id may be handed out again
+//  quit                        ok, then the connection is closed
+//  shutdown                    ok, then the server exits
+//errors reply "error <reason>". fps is sampled once a second. a session
+//stops running on a cpu error, which stats reports
@@ -0,0 +1,331 @@
+//corpus_runner.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include "rombuffer.h"
+#include "disassembler.h"
+#include "cpu.h"
+#include "cpu_soa.h"
+#include "null_io.h"
+#include "headless.h"
+
+#define ROM_DIRECTORY "../c8games/"
+#define DEFAULT_IPS 700
+#define DEFAULT_FRAMES 600
+#define USAGE "Usage: %s [-f frames] [-i ips] [-t | -j] [-p threads] [-c] " \
+              "[-s seed] [rom_directory]\n"
+
+typedef struct corpus_job {
+    char *name;
+    headless_result_t result;
+    bool loaded;
+} corpus_job_t;
+
+//shared by the workers, read only apart from next_job
+typedef struct corpus {
+    const char *directory;
+    corpus_job_t *jobs;
+    size_t length;
+    atomic_size_t next_job;
+    headless_config_t config;
+    cpu_engine_t engine;
+    uint64_t seed;
+} corpus_t;
+
+static int corpus_list(corpus_t *corpus);
+static int corpus_compare_jobs(const void *a, const void *b);
+static void *corpus_worker(void *corpus);
+static void corpus_run_job(const corpus_t *corpus, corpus_job_t *job);
+static void corpus_print_json(const corpus_t *corpus);
+static void corpus_print_csv(const corpus_t *corpus);
+static void print_json_string(const char *string);
+
+int main(int argc, char *argv[]) {
+    int opt;
+    bool csv = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    corpus_t corpus = {
+        .directory = ROM_DIRECTORY,
+        .config = {
+            .ips = DEFAULT_IPS,
+            .max_frames = DEFAULT_FRAMES,
+            .max_instructions = 0
+        },
+        .engine = CPU_ENGINE_INTERPRETER,
+        .seed = 0
+    };
+    while ((opt = getopt(argc, argv, "f:i:tjp:cs:")) != -1) {
+        if (opt == 'f') {
+            corpus.config.max_frames = strtoull(optarg, NULL, 10);
+        } else if (opt == 'i') {
+            unsigned long ips = strtoul(optarg, NULL, 10);
+            corpus.config.ips = ips > UINT32_MAX ? 0 : ips;
+        } else if (opt == 't') {
+            corpus.engine = CPU_ENGINE_THREADED;
+        } else if (opt == 'j') {
+            corpus.engine = CPU_ENGINE_JIT;
+        } else if (opt == 'p') {
+            threads = strtol(optarg, NULL, 10);
+        } else if (opt == 'c') {
+            csv = true;
+        } else if (opt == 's') {
+            corpus.seed = strtoull(optarg, NULL, 0);
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        corpus.directory = argv[optind];
+    }
+
+    if (corpus.config.max_frames == 0 || corpus.config.ips == 0) {
+        fprintf(stderr, "Error: frames and ips must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (corpus_list(&corpus)) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((size_t)threads > corpus.length && corpus.length > 0) {
+        threads = corpus.length;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t workers[threads];
+    long started = 0;
+    for (; started < threads; started++) {
+        int ret = pthread_create(&workers[started], NULL, corpus_worker,
+                                 &corpus);
+        if (ret) {
+            fprintf(stderr, "error: pthread_create() returns: %d\n", ret);
+            break;
+        }
+    }
+
+    //the calling thread helps out if no worker could be started
+    if (started == 0) {
+        corpus_worker(&corpus);
+    }
+
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (csv) {
+        corpus_print_csv(&corpus);
+    } else {
+        corpus_print_json(&corpus);
+    }
+
+    uint64_t total_instructions = 0;
+    bool failed = false;
+    for (size_t i = 0; i < corpus.length; i++) {
+        total_instructions += corpus.jobs[i].result.instructions;
+        failed |= !corpus.jobs[i].loaded || corpus.jobs[i].result.error_code;
+        free(corpus.jobs[i].name);
+    }
+    free(corpus.jobs);
+
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu roms on %ld threads in %.3f s, %.2f mips total\n",
+            corpus.length, started > 0 ? started : 1, seconds,
+            seconds > 0 ? total_instructions / seconds / 1e6 : 0.0);
+
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+//collects the regular files in the corpus directory, sorted by name
+static int corpus_list(corpus_t *corpus) {
+    DIR *directory = opendir(corpus->directory);
+    if (directory == NULL) {
+        return -1;
+    }
+
+    size_t capacity = 64;
+    corpus->jobs = malloc(capacity * sizeof(corpus_job_t));
+    corpus->length = 0;
+    if (corpus->jobs == NULL) {
+        closedir(directory);
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.' ||
+            (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN))
+        {
+            continue;
+        }
+
+        if (corpus->length == capacity) {
+            capacity *= 2;
+            corpus_job_t *grown = realloc(corpus->jobs,
+                                          capacity * sizeof(corpus_job_t));
+            if (grown == NULL) {
+                closedir(directory);
+                return -1;
+            }
+            corpus->jobs = grown;
+        }
+
+        corpus_job_t *job = &corpus->jobs[corpus->length];
+        memset(job, 0, sizeof(corpus_job_t));
+        job->name = strdup(entry->d_name);
+        if (job->name == NULL) {
+            closedir(directory);
+            return -1;
+        }
+        corpus->length++;
+    }
+    closedir(directory);
+
+    qsort(corpus->jobs, corpus->length, sizeof(corpus_job_t),
+          corpus_compare_jobs);
+    atomic_init(&corpus->next_job, 0);
+
+    return 0;
+}
+
+static int corpus_compare_jobs(const void *a, const void *b) {
+    return strcmp(((const corpus_job_t *)a)->name,
+                  ((const corpus_job_t *)b)->name);
+}
+
+//claims jobs until none are left. every job owns its cpu, rom and null io
+//instance, so the only shared write is the job index
+static void *corpus_worker(void *corpus) {
+    corpus_t *shared = corpus;
+
+    size_t index;
+    while ((index = atomic_fetch_add(&shared->next_job, 1)) <
+           shared->length)
+    {
+        corpus_run_job(shared, &shared->jobs[index]);
+    }
+
+    return NULL;
+}
+
+static void corpus_run_job(const corpus_t *corpus, corpus_job_t *job) {
+    char rom_path[strlen(corpus->directory) + strlen(job->name) + 2];
+    sprintf(rom_path, "%s/%s", corpus->directory, job->name);
+
+    FILE *rom = fopen(rom_path, "r");
+    if (rom == NULL) {
+        return;
+    }
+
+    rombuffer_t *rom_opcodes = rombuffer_read(rom);
+    fclose(rom);
+    if (rom_opcodes == NULL) {
+        return;
+    }
+
+    null_io_t *null_io = null_io_new();
+    cpu_t *cpu = cpu_new(&null_io_interface, null_io);
+    if (null_io == NULL || cpu == NULL ||
+        cpu_set_engine(cpu, corpus->engine))
+    {
+        cpu_free(cpu);
+        null_io_free(null_io);
+        rombuffer_free(rom_opcodes);
+        return;
+    }
+
+    cpu_set_seed(cpu, corpus->seed);
+    if (cpu_load(cpu, rom_opcodes) == 0) {
+        headless_run(cpu, null_io, &corpus->config, &job->result);
+        job->loaded = true;
+    }
+
+    cpu_free(cpu);
+    null_io_free(null_io);
+    rombuffer_free(rom_opcodes);
+}
+
+static void corpus_print_json(const corpus_t *corpus) {
+    printf("[\n");
+    for (size_t i = 0; i < corpus->length; i++) {
+        const corpus_job_t *job = &corpus->jobs[i];
+        const headless_result_t *result = &job->result;
+
+        printf("  {\"rom\": ");
+        print_json_string(job->name);
+        printf(", \"loaded\": %s, \"frames\": %llu, \"instructions\": %llu, "
+               "\"ips\": %.0f, \"hash\": \"%016llx\", \"error\": %d}%s\n",
+               job->loaded ? "true" : "false",
+               (unsigned long long)result->frames,
+               (unsigned long long)result->instructions,
+               result->seconds > 0 ? result->instructions / result->seconds
+                                   : 0.0,
+               (unsigned long long)result->display_hash,
+               result->error_code,
+               i + 1 < corpus->length ? "," : "");
+    }
+    printf("]\n");
+}
+
+static void corpus_print_csv(const corpus_t *corpus) {
+    printf("rom,loaded,frames,instructions,ips,hash,error\n");
+    for (size_t i = 0; i < corpus->length; i++) {
+        const corpus_job_t *job = &corpus->jobs[i];
+        const headless_result_t *result = &job->result;
+
+        //rom names containing a quote or comma are quoted, quotes doubled
+        bool quote = strpbrk(job->name, "\",\n") != NULL;
+        if (quote) {
+            putchar('"');
+            for (const char *c = job->name; *c; c++) {
+                if (*c == '"') {
+                    putchar('"');
+                }
+                putchar(*c);
+            }
+            putchar('"');
+        } else {
+            fputs(job->name, stdout);
+        }
+
+        printf(",%d,%llu,%llu,%.0f,%016llx,%d\n",
+               job->loaded,
+               (unsigned long long)result->frames,
+               (unsigned long long)result->instructions,
+               result->seconds > 0 ? result->instructions / result->seconds
+                                   : 0.0,
+               (unsigned long long)result->display_hash,
+               result->error_code);
+    }
+}
+
+static void print_json_string(const char *string) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
@@ -5,17 +5,73 @@
 #include <time.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include "rombuffer.h"
 #include "disassembler.h"
+#include "jit.h"
 #include "cpu.h"
 
 #include <unistd.h>
 
 #define SPRITE_WIDTH 8          //8 bit sprite width
-#define FONT_SPRITE_HEIGHT 5
+#define MEMORY_SIZE 4096
+#define MEMORY_PAGE_SIZE 256                  //unit of copy-on-write sharing
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define DECODE_CACHE_SIZE (MEMORY_SIZE / 2)   //one entry per even address
+#define BLOCK_MAX_LENGTH 32
+#define BLOCK_CACHE_SIZE 256                  //power of two
+#define JIT_HOT_THRESHOLD 64                  //block runs before compiling
+#define JIT_MIN_LENGTH 2                      //shorter runs stay threaded
+#define IDLE_MAX_LENGTH 8                     //instructions in a polling loop
+
+//a straight-line run of instructions with their handlers bound ahead of
+//time. ops[length] is a sentinel that leaves the dispatch loop
+typedef struct cpu_block_op {
+    const void *handler;
+    instruction_t instruction;
+} cpu_block_op_t;
+
+typedef struct cpu_block {
+    uint32_t generation;
+    uint16_t start;
+    uint16_t length;
+    cpu_block_op_t ops[BLOCK_MAX_LENGTH + 1];
+
+    //CPU_ENGINE_JIT: native code for ops[0, native_length), compiled once
+    //the block has run JIT_HOT_THRESHOLD times
+    uint32_t hotness;
+    uint16_t native_length;
+    jit_code_t native;
+} cpu_block_t;
+
+//blocks are cached direct-mapped by start address. bumping generation
+//drops every block at once, code_map marks the bytes they were built from
+typedef struct cpu_block_cache {
+    uint32_t generation;
+    uint8_t code_map[MEMORY_SIZE / 8];
+    cpu_block_t blocks[BLOCK_CACHE_SIZE];
+} cpu_block_cache_t;
+
+//256 bytes of memory with the predecoded instructions for its even
+//addresses. a page can be shared by a cpu and its clones and is copied
+//before a write while refs is above 1. an entry whose instruction_info is
+//NULL is not decoded
+typedef struct cpu_page {
+    uint32_t refs;                      //cpus pointing at the page
+    struct cpu_page *next_free;         //in a pool's free list
+    uint8_t bytes[MEMORY_PAGE_SIZE];
+    instruction_t decode_cache[MEMORY_PAGE_SIZE / 2];
+} cpu_page_t;
+
+//recycles the cpus and pages of clones instead of going through malloc
+typedef struct cpu_pool {
+    struct cpu *free_cpus;
+    cpu_page_t *free_pages;
+} cpu_pool_t;
 
 typedef struct cpu {
     const cpu_io_interface_t *cpu_io_interface;
+    void *io_context;                   //passed to every io callback
 
     uint8_t registers[16];
     uint16_t I;
@@ -28,10 +84,62 @@ typedef struct cpu {
     uint8_t sp;
     uint16_t stack[16];
 
-    uint8_t memory[4096];
+    //memory with its predecoded instructions, filled lazily by cpu_execute
+    cpu_page_t *pages[MEMORY_PAGES];
+    cpu_pool_t *pool;                   //gets the pages and cpu when freed
+    struct cpu *next_free;              //in the pool's free list
+
+    //fast reset: the pages as cpu_reset left them, shared with pages until
+    //a write copies one, which sets its bit in dirty_pages
+    bool fast_reset;
+    cpu_page_t *pristine[MEMORY_PAGES];
+    uint16_t dirty_pages;
+
+    //one bit per pixel, pixel x of a row is bit 63 - x
+    uint64_t display[DISPLAY_HEIGHT];
+    uint32_t dirty_rows;                //rows changed since cpu_present
+
+    cpu_engine_t engine;
+    cpu_block_cache_t *block_cache;     //allocated for CPU_ENGINE_THREADED
+    jit_t *jit;                         //allocated for CPU_ENGINE_JIT
+
+    uint64_t instruction_count;
+
+    //xorshift64* generator for RND, restarted from seed by cpu_reset
+    uint64_t seed;
+    uint64_t random_state;
+
+    bool drawn;                         //set by CLS and DRW for cpu_run
+
+    //state at the last backward transfer, compared by cpu_idle_loop
+    uint16_t idle_head;
+    uint16_t idle_I;
+    uint8_t idle_registers[16];
+    uint64_t idle_count;
 } cpu_t;
 
-static const uint8_t font_library[] = {
+#define CPU_STATE_MAGIC 0x38504843      //"CHP8" on little endian hosts
+#define CPU_STATE_VERSION 2
+
+//save state blob, host byte order. fields are ordered by size so the
+//struct has no padding besides the tail
+typedef struct cpu_state {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t instruction_count;
+    uint64_t random_state;
+    uint64_t display[DISPLAY_HEIGHT];
+    uint16_t I;
+    uint16_t pc;
+    uint16_t stack[16];
+    uint8_t registers[16];
+    uint8_t DT;
+    uint8_t ST;
+    uint8_t sp;
+    uint8_t memory[MEMORY_SIZE];
+} cpu_state_t;
+
+const uint8_t cpu_font_library[FONT_LIBRARY_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0,       // 0
     0x20, 0x60, 0x20, 0x20, 0x70,       // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0,       // 2
@@ -50,21 +158,25 @@ static const uint8_t font_library[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80,       // f
 };
 
-static const size_t font_library_size = sizeof(font_library) / sizeof(uint8_t);
-
-static uint16_t cpu_fetch_opcode(cpu_t *cpu);
-
-enum cpu_error_code {
-    CPU_ERROR_SUCCESS          =  0,    //success
-    CPU_ERROR_NULL_PNTR        = -1,    //NULL pointer returned
-    CPU_ERROR_8BIT_OOB         = -2,    //value exceeds 0x0F
-    CPU_ERROR_PC_OOB           = -3,    //pc set to memory address < 0x2
-    CPU_ERROR_WRITE_OOB        = -4,    //attempted write to memory addr
-    CPU_ERROR_STACK_UNDERFLOW  = -5,    //stack underflow
-    CPU_ERROR_STACK_OVERFLOW   = -6,    //stack overflow
-    CPU_ERROR_DATA_EXEC        = -7,    //data opcode ran as executable
-    CPU_ERROR_UNSUPORTED       = -8     //unsupported opcode ran as executable
-};
+static cpu_page_t *cpu_page_new(cpu_pool_t *pool);
+static void cpu_page_release(cpu_pool_t *pool, cpu_page_t *page);
+static void cpu_release_pristine(cpu_t *cpu);
+static void cpu_clear_state(cpu_t *cpu);
+static cpu_page_t *cpu_own_page(cpu_t *cpu, uint8_t index);
+static int cpu_own_range(cpu_t *cpu, uint16_t address, uint16_t length);
+static uint8_t cpu_read_memory(const cpu_t *cpu, uint16_t address);
+static int cpu_write_memory(cpu_t *cpu, uint16_t address, uint8_t value);
+static uint16_t cpu_fetch_opcode(cpu_t *cpu, uint16_t address);
+static const instruction_t *cpu_decode(cpu_t *cpu, uint16_t address,
+                                       instruction_t *scratch);
+static void cpu_invalidate_code(cpu_t *cpu, uint16_t address, uint16_t length);
+static int cpu_step(cpu_t *cpu);
+static bool cpu_idle_loop(cpu_t *cpu);
+static bool cpu_idle_body(cpu_t *cpu, uint16_t head);
+static bool cpu_block_terminator(instruction_type_t instruction_type);
+static int cpu_run_block(cpu_t *cpu, uint32_t budget);
+static void cpu_compile_block(cpu_t *cpu, cpu_block_t *block);
+static void cpu_flush_blocks(cpu_t *cpu);
 
 static int cpu_exec_sys_nnn(cpu_t *cpu, const instruction_t *instruction);
 static int cpu_exec_cls(cpu_t *cpu, const instruction_t *instruction);
@@ -143,25 +255,126 @@ static int (* const exec_instruction_table[])
     [INSTRUCTION_DATA]        = cpu_exec_data
 };
 
-cpu_t *cpu_new(const cpu_io_interface_t *cpu_io_interface) {
+cpu_t *cpu_new(const cpu_io_interface_t *cpu_io_interface, void *io_context) {
     cpu_t *cpu = malloc(sizeof(cpu_t));
     if (cpu == NULL) {
         return NULL;
     }
 
+    cpu->pool = NULL;
+    cpu->fast_reset = false;
+    memset(cpu->pristine, 0, sizeof(cpu->pristine));
+    cpu->dirty_pages = 0;
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        cpu->pages[i] = cpu_page_new(NULL);
+        if (cpu->pages[i] == NULL) {
+            while (i-- > 0) {
+                cpu_page_release(NULL, cpu->pages[i]);
+            }
+            free(cpu);
+            return NULL;
+        }
+    }
+
     cpu->cpu_io_interface = cpu_io_interface;
+    cpu->io_context = io_context;
+    cpu->engine = CPU_ENGINE_INTERPRETER;
+    cpu->block_cache = NULL;
+    cpu->jit = NULL;
+    cpu->instruction_count = 0;
+    cpu->seed = 0;
+    cpu->random_state = cpu_random_init(cpu->seed);
+    cpu->drawn = false;
+    cpu->idle_head = 0;
 
     return cpu;
 }
 
+int cpu_set_engine(cpu_t *cpu, cpu_engine_t engine) {
+    if (cpu == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    if (engine != CPU_ENGINE_INTERPRETER && cpu->block_cache == NULL) {
+        cpu->block_cache = calloc(1, sizeof(cpu_block_cache_t));
+        if (cpu->block_cache == NULL) {
+            return CPU_ERROR_NULL_PNTR;
+        }
+    }
+
+    if (engine == CPU_ENGINE_JIT && cpu->jit == NULL) {
+        const jit_layout_t layout = {
+            .registers = offsetof(cpu_t, registers),
+            .I = offsetof(cpu_t, I),
+            .DT = offsetof(cpu_t, DT),
+            .ST = offsetof(cpu_t, ST),
+            .pc = offsetof(cpu_t, pc)
+        };
+
+        cpu->jit = jit_new(&layout);
+        if (cpu->jit == NULL) {
+            return CPU_ERROR_NULL_PNTR;
+        }
+    }
+
+    //native code belongs to cached blocks, so start from a clean cache
+    if (cpu->block_cache != NULL) {
+        cpu_flush_blocks(cpu);
+    }
+
+    cpu->engine = engine;
+
+    return 0;
+}
+
+//restarts RND from seed, cpu_reset and cpu_load restart it from there too
+int cpu_set_seed(cpu_t *cpu, uint64_t seed) {
+    if (cpu == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    cpu->seed = seed;
+    cpu->random_state = cpu_random_init(seed);
+
+    return 0;
+}
+
+//true when the next instruction waits for a key press
+bool cpu_key_wait_pending(cpu_t *cpu) {
+    if (cpu == NULL) {
+        return false;
+    }
+
+    instruction_t scratch;
+    const instruction_t *instruction = cpu_decode(cpu, cpu->pc, &scratch);
+
+    return instruction->instruction_info->instruction_type ==
+           INSTRUCTION_LD_VX_K;
+}
+
+uint64_t cpu_get_instruction_count(const cpu_t *cpu) {
+    if (cpu == NULL) {
+        return 0;
+    }
+
+    return cpu->instruction_count;
+}
+
+//reads a byte of memory, for frontends that watch game variables
+uint8_t cpu_peek(const cpu_t *cpu, uint16_t address) {
+    if (cpu == NULL) {
+        return 0;
+    }
+
+    return cpu_read_memory(cpu, address);
+}
+
 int cpu_load(cpu_t *cpu, const rombuffer_t *rom) {
     if (cpu == NULL || rom == NULL) {
         return CPU_ERROR_NULL_PNTR;
     }
 
-    cpu_reset(cpu, rom);
-    
-    return 0;
+    return cpu_reset(cpu, rom);
 }
 
 int cpu_reset(cpu_t *cpu, const rombuffer_t *rom) {
@@ -169,38 +382,183 @@ int cpu_reset(cpu_t *cpu, const rombuffer_t *rom) {
         return CPU_ERROR_NULL_PNTR;
     }
 
-    memset(cpu->registers, 0, sizeof(cpu->registers));
-    cpu->I = 0;
-    cpu->DT = 0;
-    cpu->ST = 0;
-    cpu->pc = 0;
-    cpu->sp = 0;
-    memset(cpu->stack, 0, sizeof(cpu->stack));
-    memset(cpu->memory, 0, sizeof(cpu->memory));
+    cpu_clear_state(cpu);
 
-    memcpy(cpu->memory, font_library, font_library_size);
+    //the old image would make every page below a copy
+    cpu_release_pristine(cpu);
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        cpu_page_t *page = cpu_own_page(cpu, i);
+        if (page == NULL) {
+            return CPU_ERROR_NULL_PNTR;
+        }
+        memset(page->bytes, 0, sizeof(page->bytes));
+        memset(page->decode_cache, 0, sizeof(page->decode_cache));
+    }
+    memset(cpu->display, 0, sizeof(cpu->display));
+    cpu->dirty_rows = UINT32_MAX;
+    if (cpu->block_cache != NULL) {
+        cpu_flush_blocks(cpu);
+    }
 
-    cpu->pc = 0x200;
+    memcpy(cpu->pages[0]->bytes, cpu_font_library, FONT_LIBRARY_SIZE);
+
+    //every page is private after the loop above, so the writes cannot fail
     for (size_t i = 0; i < rom->length; i++) {
-        cpu->memory[0x200 + (i * 2)] = (uint8_t)((rom->data[i] & 0xFF00) >> 8); 
-        cpu->memory[0x200 + (i * 2) + 1] = (uint8_t)(rom->data[i] & 0x00FF); 
+        cpu_write_memory(cpu, 0x200 + (i * 2),
+                         (uint8_t)((rom->data[i] & 0xFF00) >> 8));
+        cpu_write_memory(cpu, 0x200 + (i * 2) + 1,
+                         (uint8_t)(rom->data[i] & 0x00FF));
+    }
+
+    //share the fresh image, so the first write to a page copies it and
+    //marks it dirty
+    if (cpu->fast_reset) {
+        for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+            cpu->pristine[i] = cpu->pages[i];
+            cpu->pristine[i]->refs++;
+        }
+    }
+    cpu->dirty_pages = 0;
+
+    return 0;
+}
+
+//keeps the image cpu_load and cpu_reset produce from then on, for
+//cpu_reset_fast
+int cpu_set_fast_reset(cpu_t *cpu, bool enabled) {
+    if (cpu == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    cpu->fast_reset = enabled;
+    if (!enabled) {
+        cpu_release_pristine(cpu);
     }
 
     return 0;
 }
 
+//returns to the state of the last cpu_reset, putting back only the pages
+//written since and clearing only the rows lit since. cached code survives
+//unless it was built from bytes that changed
+int cpu_reset_fast(cpu_t *cpu) {
+    if (cpu == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    if (cpu->pristine[0] == NULL) {
+        return CPU_ERROR_STATE;
+    }
+
+    for (uint16_t dirty = cpu->dirty_pages; dirty; dirty &= dirty - 1) {
+        uint8_t i = __builtin_ctz(dirty);
+        cpu_page_t *page = cpu->pages[i];
+        cpu_page_t *pristine = cpu->pristine[i];
+        if (page == pristine) {
+            continue;
+        }
+
+        for (uint16_t j = 0; j < MEMORY_PAGE_SIZE; j++) {
+            if (page->bytes[j] != pristine->bytes[j]) {
+                cpu_invalidate_code(cpu, i * MEMORY_PAGE_SIZE + j, 1);
+            }
+        }
+
+        cpu_page_release(cpu->pool, page);
+        cpu->pages[i] = pristine;
+        pristine->refs++;
+    }
+    cpu->dirty_pages = 0;
+
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (cpu->display[y]) {
+            cpu->display[y] = 0;
+            cpu->dirty_rows |= 1U << y;
+        }
+    }
+
+    cpu_clear_state(cpu);
+
+    return 0;
+}
+
+//executes one instruction, or one translated block with CPU_ENGINE_THREADED
+//and CPU_ENGINE_JIT
 int cpu_execute(cpu_t *cpu) {
-    //fetch
-    const uint16_t opcode = cpu_fetch_opcode(cpu);
-    //decode
-    instruction_t instruction;
-    disassembler_disassemble(&instruction, opcode);
+    if (cpu->engine != CPU_ENGINE_INTERPRETER) {
+        return cpu_run_block(cpu, BLOCK_MAX_LENGTH);
+    }
 
-    //execute
-    int error_code = exec_instruction_table[instruction.instruction_info->
-                     instruction_type](cpu, &instruction);
-    if ((error_code )) {
-        return error_code;
+    return cpu_step(cpu);
+}
+
+//executes up to max_cycles instructions, stopping early after CLS or DRW,
+//before a key wait, in an idle loop, or on an error. a key wait at the very start of the run is executed, and blocks
+int cpu_run(cpu_t *cpu, uint32_t max_cycles, cpu_run_result_t *result) {
+    if (cpu == NULL || result == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    result->stop_reason = CPU_STOP_CYCLES;
+    result->cycles = 0;
+    result->error_code = 0;
+
+    while (result->cycles < max_cycles) {
+        uint32_t budget = max_cycles - result->cycles;
+
+        if (result->cycles > 0 && cpu_key_wait_pending(cpu)) {
+            result->stop_reason = CPU_STOP_KEY_WAIT;
+            break;
+        }
+
+        uint64_t instruction_count = cpu->instruction_count;
+        uint16_t pc = cpu->pc;
+        int error_code;
+        if (cpu->engine == CPU_ENGINE_INTERPRETER) {
+            error_code = cpu_step(cpu);
+        } else {
+            error_code = cpu_run_block(cpu, budget);
+        }
+
+        uint32_t executed = cpu->instruction_count - instruction_count;
+        result->cycles += executed;
+
+        if (error_code) {
+            result->stop_reason = CPU_STOP_ERROR;
+            result->error_code = error_code;
+            break;
+        }
+
+        if (cpu->drawn) {
+            cpu->drawn = false;
+            result->stop_reason = CPU_STOP_DRAW;
+            break;
+        }
+
+        //blocks are straight-line code, so this is the address of the last
+        //instruction on every engine and idle loops are found at the same
+        //instruction counts
+        uint16_t last_pc = pc + 2 * (executed - 1);
+        if (cpu->pc <= last_pc && cpu_idle_loop(cpu)) {
+            result->stop_reason = CPU_STOP_IDLE;
+            break;
+        }
+    }
+
+    return result->error_code;
+}
+
+//hands the display to the io interface if any row changed since the
+//last call
+int cpu_present(cpu_t *cpu) {
+    if (cpu == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    if (cpu->dirty_rows) {
+        cpu->cpu_io_interface->present_frame(cpu->io_context, cpu->display,
+                                            cpu->dirty_rows);
+        cpu->dirty_rows = 0;
     }
 
     return 0;
@@ -222,33 +580,723 @@ int cpu_decrement_timers(cpu_t *cpu) {
     return 0;
 }
 
+size_t cpu_state_size() {
+    return sizeof(cpu_state_t);
+}
+
+//writes the machine state into buffer, which needs cpu_state_size bytes
+int cpu_save_state(const cpu_t *cpu, void *buffer, size_t size) {
+    if (cpu == NULL || buffer == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    if (size < sizeof(cpu_state_t)) {
+        return CPU_ERROR_STATE;
+    }
+
+    //zeroed first so the padding is not left uninitialised in the blob
+    cpu_state_t *state = buffer;
+    memset(state, 0, sizeof(cpu_state_t));
+    state->magic = CPU_STATE_MAGIC;
+    state->version = CPU_STATE_VERSION;
+    state->instruction_count = cpu->instruction_count;
+    state->random_state = cpu->random_state;
+    memcpy(state->display, cpu->display, sizeof(state->display));
+    state->I = cpu->I;
+    state->pc = cpu->pc;
+    memcpy(state->stack, cpu->stack, sizeof(state->stack));
+    memcpy(state->registers, cpu->registers, sizeof(state->registers));
+    state->DT = cpu->DT;
+    state->ST = cpu->ST;
+    state->sp = cpu->sp;
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        memcpy(&state->memory[i * MEMORY_PAGE_SIZE], cpu->pages[i]->bytes,
+               MEMORY_PAGE_SIZE);
+    }
+
+    return 0;
+}
+
+//restores a blob written by cpu_save_state. cached code is only dropped
+//for memory pages that differ, and only changed rows are presented again
+int cpu_load_state(cpu_t *cpu, const void *buffer, size_t size) {
+    if (cpu == NULL || buffer == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    const cpu_state_t *state = buffer;
+    if (size < sizeof(cpu_state_t) || state->magic != CPU_STATE_MAGIC ||
+        state->version != CPU_STATE_VERSION)
+    {
+        return CPU_ERROR_STATE;
+    }
+
+    //checked before anything changes, a corrupt blob leaves the cpu as it
+    //was instead of indexing out of the stack or memory later on. pc is
+    //not checked: JP V0 and running off the end take it past MEMORY_SIZE,
+    //and every fetch wraps it
+    if (state->sp > 15 || state->I >= MEMORY_SIZE ||
+        state->random_state == 0)
+    {
+        return CPU_ERROR_STATE;
+    }
+
+    //every differing page is owned before any is copied into, so running
+    //out of memory leaves the cpu as it was
+    uint16_t changed = 0;
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        const uint8_t *bytes = &state->memory[i * MEMORY_PAGE_SIZE];
+        if (memcmp(cpu->pages[i]->bytes, bytes, MEMORY_PAGE_SIZE)) {
+            if (cpu_own_page(cpu, i) == NULL) {
+                return CPU_ERROR_NULL_PNTR;
+            }
+            changed |= 1U << i;
+        }
+    }
+
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        if (changed & 1U << i) {
+            memcpy(cpu->pages[i]->bytes, &state->memory[i * MEMORY_PAGE_SIZE],
+                   MEMORY_PAGE_SIZE);
+            cpu_invalidate_code(cpu, i * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+        }
+    }
+
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (cpu->display[y] != state->display[y]) {
+            cpu->display[y] = state->display[y];
+            cpu->dirty_rows |= 1U << y;
+        }
+    }
+
+    cpu->instruction_count = state->instruction_count;
+    cpu->random_state = state->random_state;
+    cpu->I = state->I;
+    cpu->pc = state->pc;
+    memcpy(cpu->stack, state->stack, sizeof(cpu->stack));
+    memcpy(cpu->registers, state->registers, sizeof(cpu->registers));
+    cpu->DT = state->DT;
+    cpu->ST = state->ST;
+    cpu->sp = state->sp;
+    cpu->drawn = false;
+    cpu->idle_head = 0;
+
+    return 0;
+}
+
 void cpu_free(cpu_t *cpu) {
     if (cpu == NULL) {
         return;
     }
 
+    jit_free(cpu->jit);
+    free(cpu->block_cache);
+
+    cpu_release_pristine(cpu);
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        cpu_page_release(cpu->pool, cpu->pages[i]);
+    }
+
+    if (cpu->pool != NULL) {
+        cpu->next_free = cpu->pool->free_cpus;
+        cpu->pool->free_cpus = cpu;
+        return;
+    }
+
     free(cpu);
     return;
 }
 
-static uint16_t cpu_fetch_opcode(cpu_t *cpu) {
-    uint16_t opcode = (cpu->memory[cpu->pc] << 8) | (cpu->memory[cpu->pc + 1]);
+cpu_pool_t *cpu_pool_new() {
+    return calloc(1, sizeof(cpu_pool_t));
+}
+
+//copies cpu, sharing its memory until either of them writes to a page.
+//with a pool the clone is taken from and returned to it
+cpu_t *cpu_clone(const cpu_t *cpu, cpu_pool_t *pool) {
+    if (cpu == NULL) {
+        return NULL;
+    }
+
+    cpu_t *clone;
+    if (pool != NULL && pool->free_cpus != NULL) {
+        clone = pool->free_cpus;
+        pool->free_cpus = clone->next_free;
+    } else {
+        clone = malloc(sizeof(cpu_t));
+        if (clone == NULL) {
+            return NULL;
+        }
+    }
+
+    memcpy(clone, cpu, sizeof(cpu_t));
+    clone->pool = pool;
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        clone->pages[i]->refs++;
+        if (clone->pristine[i] != NULL) {
+            clone->pristine[i]->refs++;
+        }
+    }
+
+    //block caches are too big to copy per clone
+    clone->engine = CPU_ENGINE_INTERPRETER;
+    clone->block_cache = NULL;
+    clone->jit = NULL;
+
+    return clone;
+}
+
+void cpu_pool_free(cpu_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    while (pool->free_cpus != NULL) {
+        cpu_t *cpu = pool->free_cpus;
+        pool->free_cpus = cpu->next_free;
+        free(cpu);
+    }
+
+    while (pool->free_pages != NULL) {
+        cpu_page_t *page = pool->free_pages;
+        pool->free_pages = page->next_free;
+        free(page);
+    }
+
+    free(pool);
+}
+
+static cpu_page_t *cpu_page_new(cpu_pool_t *pool) {
+    cpu_page_t *page;
+    if (pool != NULL && pool->free_pages != NULL) {
+        page = pool->free_pages;
+        pool->free_pages = page->next_free;
+    } else {
+        page = calloc(1, sizeof(cpu_page_t));
+        if (page == NULL) {
+            return NULL;
+        }
+    }
+
+    page->refs = 1;
+
+    return page;
+}
+
+static void cpu_page_release(cpu_pool_t *pool, cpu_page_t *page) {
+    if (--page->refs > 0) {
+        return;
+    }
+
+    if (pool != NULL) {
+        page->next_free = pool->free_pages;
+        pool->free_pages = page;
+        return;
+    }
+
+    free(page);
+}
+
+static void cpu_release_pristine(cpu_t *cpu) {
+    for (uint8_t i = 0; i < MEMORY_PAGES; i++) {
+        if (cpu->pristine[i] != NULL) {
+            cpu_page_release(cpu->pool, cpu->pristine[i]);
+            cpu->pristine[i] = NULL;
+        }
+    }
+}
+
+//the registers and everything else cpu_reset and cpu_reset_fast restore
+//besides memory and the display
+static void cpu_clear_state(cpu_t *cpu) {
+    memset(cpu->registers, 0, sizeof(cpu->registers));
+    cpu->I = 0;
+    cpu->DT = 0;
+    cpu->ST = 0;
+    cpu->pc = 0x200;
+    cpu->sp = 0;
+    memset(cpu->stack, 0, sizeof(cpu->stack));
+    cpu->idle_head = 0;
+    cpu->random_state = cpu_random_init(cpu->seed);
+}
+
+//makes page index private to cpu ahead of a write, copying it while it is
+//shared. the copy keeps the decoded instructions, the writer invalidates
+//what it changes
+static cpu_page_t *cpu_own_page(cpu_t *cpu, uint8_t index) {
+    cpu_page_t *page = cpu->pages[index];
+    if (page->refs == 1) {
+        return page;
+    }
+
+    cpu_page_t *copy = cpu_page_new(cpu->pool);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    memcpy(copy->bytes, page->bytes, sizeof(page->bytes));
+    memcpy(copy->decode_cache, page->decode_cache,
+           sizeof(page->decode_cache));
+    page->refs--;
+    cpu->pages[index] = copy;
+    cpu->dirty_pages |= 1U << index;
+
+    return copy;
+}
+
+//owns every page a write of length bytes at address touches, so that the
+//write itself cannot fail halfway through
+static int cpu_own_range(cpu_t *cpu, uint16_t address, uint16_t length) {
+    for (uint16_t offset = 0; offset < length; offset++) {
+        uint16_t index = (address + offset) % MEMORY_SIZE / MEMORY_PAGE_SIZE;
+        if (cpu_own_page(cpu, index) == NULL) {
+            return CPU_ERROR_NULL_PNTR;
+        }
+    }
+
+    return 0;
+}
+
+//addresses wrap around at the end of memory
+static uint8_t cpu_read_memory(const cpu_t *cpu, uint16_t address) {
+    address %= MEMORY_SIZE;
+
+    return cpu->pages[address / MEMORY_PAGE_SIZE]->
+           bytes[address % MEMORY_PAGE_SIZE];
+}
+
+static int cpu_write_memory(cpu_t *cpu, uint16_t address, uint8_t value) {
+    address %= MEMORY_SIZE;
+
+    cpu_page_t *page = cpu_own_page(cpu, address / MEMORY_PAGE_SIZE);
+    if (page == NULL) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+    page->bytes[address % MEMORY_PAGE_SIZE] = value;
+
+    return 0;
+}
+
+static uint16_t cpu_fetch_opcode(cpu_t *cpu, uint16_t address) {
+    uint16_t opcode = (cpu_read_memory(cpu, address) << 8) |
+                      cpu_read_memory(cpu, address + 1);
 
     return opcode;
 }
 
+//returns the decoded instruction at address, decoding into the cache on a
+//miss. odd addresses are not cached and are decoded into scratch instead
+static const instruction_t *cpu_decode(cpu_t *cpu, uint16_t address,
+                                       instruction_t *scratch) {
+    if (address & 0x01) {
+        disassembler_disassemble(scratch, cpu_fetch_opcode(cpu, address));
+        return scratch;
+    }
+
+    address %= MEMORY_SIZE;
+    cpu_page_t *page = cpu->pages[address / MEMORY_PAGE_SIZE];
+    instruction_t *instruction =
+        &page->decode_cache[(address % MEMORY_PAGE_SIZE) >> 1];
+    if (instruction->instruction_info == NULL) {
+        disassembler_disassemble(instruction, cpu_fetch_opcode(cpu, address));
+    }
+
+    return instruction;
+}
+
+//drop cached decodes and blocks overlapping memory[address, address + length)
+static void cpu_invalidate_code(cpu_t *cpu, uint16_t address, uint16_t length) {
+    //an opcode at the even address below may straddle the first byte
+    uint32_t first = address >> 1;
+    uint32_t last = (address + length - 1) >> 1;
+
+    for (uint32_t i = first; i <= last; i++) {
+        uint16_t entry = i % DECODE_CACHE_SIZE;
+        cpu_page_t *page = cpu->pages[entry / (MEMORY_PAGE_SIZE / 2)];
+        page->decode_cache[entry % (MEMORY_PAGE_SIZE / 2)].instruction_info =
+            NULL;
+    }
+
+    cpu_block_cache_t *block_cache = cpu->block_cache;
+    if (block_cache == NULL) {
+        return;
+    }
+
+    for (uint32_t i = address; i < (uint32_t)address + length; i++) {
+        uint16_t byte = i % MEMORY_SIZE;
+        if (block_cache->code_map[byte >> 3] & (1 << (byte & 0x07))) {
+            cpu_flush_blocks(cpu);
+            return;
+        }
+    }
+}
+
+//interprets the instruction at pc
+static int cpu_step(cpu_t *cpu) {
+    //fetch and decode
+    instruction_t scratch;
+    const instruction_t *instruction = cpu_decode(cpu, cpu->pc, &scratch);
+
+    //execute
+    int error_code = exec_instruction_table[instruction->instruction_info->
+                     instruction_type](cpu, instruction);
+    if ((error_code )) {
+        return error_code;
+    }
+
+    cpu->instruction_count++;
+
+    return 0;
+}
+
+//scrambles seed with splitmix64 so nearby seeds give unrelated sequences.
+//xorshift must never be seeded with 0
+uint64_t cpu_random_init(uint64_t seed) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    return z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+}
+
+//advances the xorshift64* generator and returns its top byte
+uint8_t cpu_random_next(uint64_t *random_state) {
+    uint64_t x = *random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *random_state = x;
+
+    return (x * 0x2545F4914F6CDD1DULL) >> 56;
+}
+
+//called after a backward transfer to pc. true when the loop at pc just
+//repeated an iteration without changing any register or I, and its body
+//only reads registers, DT and the keys: every further iteration is the
+//same until DT or the keys change
+static bool cpu_idle_loop(cpu_t *cpu) {
+    uint16_t head = cpu->pc;
+
+    if (cpu->idle_head == head &&
+        cpu->instruction_count - cpu->idle_count <= IDLE_MAX_LENGTH &&
+        cpu->idle_I == cpu->I &&
+        !memcmp(cpu->idle_registers, cpu->registers, sizeof(cpu->registers)) &&
+        cpu_idle_body(cpu, head))
+    {
+        cpu->idle_count = cpu->instruction_count;
+        return true;
+    }
+
+    cpu->idle_head = head;
+    cpu->idle_I = cpu->I;
+    memcpy(cpu->idle_registers, cpu->registers, sizeof(cpu->registers));
+    cpu->idle_count = cpu->instruction_count;
+
+    return false;
+}
+
+//true if the code at head is a short run of register, DT and key polling
+//instructions closed by a jump back to head
+static bool cpu_idle_body(cpu_t *cpu, uint16_t head) {
+    uint16_t address = head;
+
+    for (uint8_t i = 0; i < IDLE_MAX_LENGTH && address + 1 < MEMORY_SIZE; i++) {
+        instruction_t scratch;
+        const instruction_t *instruction = cpu_decode(cpu, address, &scratch);
+
+        switch (instruction->instruction_info->instruction_type) {
+            case INSTRUCTION_JP_NNN:
+                return instruction->operands[0] == head;
+            case INSTRUCTION_SE_VX_KK:
+            case INSTRUCTION_SNE_VX_KK:
+            case INSTRUCTION_SE_VX_VY:
+            case INSTRUCTION_SNE_VX_VY:
+            case INSTRUCTION_SKP_VX:
+            case INSTRUCTION_SKNP_VX:
+            case INSTRUCTION_LD_VX_DT:
+            case INSTRUCTION_LD_VX_KK:
+            case INSTRUCTION_LD_VX_VY:
+            case INSTRUCTION_OR_VX_VY:
+            case INSTRUCTION_AND_VX_VY:
+            case INSTRUCTION_XOR_VX_VY:
+            case INSTRUCTION_ADD_VX_VY:
+            case INSTRUCTION_SUB_VX_VY:
+            case INSTRUCTION_SHR_VX_VY:
+            case INSTRUCTION_SUBN_VX_VY:
+            case INSTRUCTION_SHL_VX_VY:
+            case INSTRUCTION_LD_I_NNN:
+                break;
+            default:
+                return false;
+        }
+
+        address += 2;
+    }
+
+    return false;
+}
+
+//true for instructions that end a block: anything that may leave the
+//straight-line path, write memory, draw, block on input or not advance pc
+static bool cpu_block_terminator(instruction_type_t instruction_type) {
+    switch (instruction_type) {
+        case INSTRUCTION_SYS_NNN:
+        case INSTRUCTION_CLS:
+        case INSTRUCTION_RET:
+        case INSTRUCTION_JP_NNN:
+        case INSTRUCTION_CALL_NNN:
+        case INSTRUCTION_SE_VX_KK:
+        case INSTRUCTION_SNE_VX_KK:
+        case INSTRUCTION_SE_VX_VY:
+        case INSTRUCTION_SNE_VX_VY:
+        case INSTRUCTION_JP_V0_NNN:
+        case INSTRUCTION_DRW_VX_VY_N:
+        case INSTRUCTION_SKP_VX:
+        case INSTRUCTION_SKNP_VX:
+        case INSTRUCTION_LD_VX_K:
+        case INSTRUCTION_LD_B_VX:
+        case INSTRUCTION_LD_I_VX:
+        case INSTRUCTION_DATA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//runs the block starting at pc, translating it first if it is not cached.
+//at most budget instructions are executed, odd addresses use cpu_step
+static int cpu_run_block(cpu_t *cpu, uint32_t budget) {
+    #define OP_HANDLER(type, function)                                      \
+        op_##type:                                                          \
+            error_code = function(cpu, &op->instruction);                   \
+            if (error_code) {                                               \
+                goto block_exit;                                            \
+            }                                                               \
+            op++;                                                           \
+            goto *op->handler;
+
+    //key reads bring instruction_count up to date first, so io backends see
+    //the same count on every engine
+    #define KEY_OP_HANDLER(type, function)                                  \
+        op_##type:                                                          \
+            cpu->instruction_count += op - counted;                         \
+            counted = op;                                                   \
+            error_code = function(cpu, &op->instruction);                   \
+            if (error_code) {                                               \
+                goto block_exit;                                            \
+            }                                                               \
+            op++;                                                           \
+            goto *op->handler;
+
+    static const void * const dispatch_table[] = {
+        [INSTRUCTION_SYS_NNN]     = &&op_INSTRUCTION_SYS_NNN,
+        [INSTRUCTION_CLS]         = &&op_INSTRUCTION_CLS,
+        [INSTRUCTION_RET]         = &&op_INSTRUCTION_RET,
+        [INSTRUCTION_JP_NNN]      = &&op_INSTRUCTION_JP_NNN,
+        [INSTRUCTION_CALL_NNN]    = &&op_INSTRUCTION_CALL_NNN,
+        [INSTRUCTION_SE_VX_KK]    = &&op_INSTRUCTION_SE_VX_KK,
+        [INSTRUCTION_SNE_VX_KK]   = &&op_INSTRUCTION_SNE_VX_KK,
+        [INSTRUCTION_SE_VX_VY]    = &&op_INSTRUCTION_SE_VX_VY,
+        [INSTRUCTION_LD_VX_KK]    = &&op_INSTRUCTION_LD_VX_KK,
+        [INSTRUCTION_ADD_VX_KK]   = &&op_INSTRUCTION_ADD_VX_KK,
+        [INSTRUCTION_LD_VX_VY]    = &&op_INSTRUCTION_LD_VX_VY,
+        [INSTRUCTION_OR_VX_VY]    = &&op_INSTRUCTION_OR_VX_VY,
+        [INSTRUCTION_AND_VX_VY]   = &&op_INSTRUCTION_AND_VX_VY,
+        [INSTRUCTION_XOR_VX_VY]   = &&op_INSTRUCTION_XOR_VX_VY,
+        [INSTRUCTION_ADD_VX_VY]   = &&op_INSTRUCTION_ADD_VX_VY,
+        [INSTRUCTION_SUB_VX_VY]   = &&op_INSTRUCTION_SUB_VX_VY,
+        [INSTRUCTION_SHR_VX_VY]   = &&op_INSTRUCTION_SHR_VX_VY,
+        [INSTRUCTION_SUBN_VX_VY]  = &&op_INSTRUCTION_SUBN_VX_VY,
+        [INSTRUCTION_SHL_VX_VY]   = &&op_INSTRUCTION_SHL_VX_VY,
+        [INSTRUCTION_SNE_VX_VY]   = &&op_INSTRUCTION_SNE_VX_VY,
+        [INSTRUCTION_LD_I_NNN]    = &&op_INSTRUCTION_LD_I_NNN,
+        [INSTRUCTION_JP_V0_NNN]   = &&op_INSTRUCTION_JP_V0_NNN,
+        [INSTRUCTION_RND_VX_KK]   = &&op_INSTRUCTION_RND_VX_KK,
+        [INSTRUCTION_DRW_VX_VY_N] = &&op_INSTRUCTION_DRW_VX_VY_N,
+        [INSTRUCTION_SKP_VX]      = &&op_INSTRUCTION_SKP_VX,
+        [INSTRUCTION_SKNP_VX]     = &&op_INSTRUCTION_SKNP_VX,
+        [INSTRUCTION_LD_VX_DT]    = &&op_INSTRUCTION_LD_VX_DT,
+        [INSTRUCTION_LD_VX_K]     = &&op_INSTRUCTION_LD_VX_K,
+        [INSTRUCTION_LD_DT_VX]    = &&op_INSTRUCTION_LD_DT_VX,
+        [INSTRUCTION_LD_ST_VX]    = &&op_INSTRUCTION_LD_ST_VX,
+        [INSTRUCTION_ADD_I_VX]    = &&op_INSTRUCTION_ADD_I_VX,
+        [INSTRUCTION_LD_F_VX]     = &&op_INSTRUCTION_LD_F_VX,
+        [INSTRUCTION_LD_B_VX]     = &&op_INSTRUCTION_LD_B_VX,
+        [INSTRUCTION_LD_I_VX]     = &&op_INSTRUCTION_LD_I_VX,
+        [INSTRUCTION_LD_VX_I]     = &&op_INSTRUCTION_LD_VX_I,
+        [INSTRUCTION_DATA]        = &&op_INSTRUCTION_DATA
+    };
+
+    if (cpu->pc & 0x01) {
+        return cpu_step(cpu);
+    }
+
+    cpu_block_cache_t *block_cache = cpu->block_cache;
+    cpu_block_t *block = &block_cache->blocks[(cpu->pc >> 1) &
+                                              (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->generation != block_cache->generation ||
+        block->start != cpu->pc)
+    {
+        //translate
+        uint16_t address = cpu->pc;
+        uint16_t length = 0;
+        while (length < BLOCK_MAX_LENGTH && address + 1 < MEMORY_SIZE) {
+            instruction_t scratch;
+            const instruction_t *instruction = cpu_decode(cpu, address,
+                                                          &scratch);
+            instruction_type_t instruction_type =
+                instruction->instruction_info->instruction_type;
+
+            //a key wait starts its own block so cpu_run can stop before it
+            if (instruction_type == INSTRUCTION_LD_VX_K && length > 0) {
+                break;
+            }
+
+            block->ops[length].handler = dispatch_table[instruction_type];
+            block->ops[length].instruction = *instruction;
+            block_cache->code_map[address >> 3] |= 1 << (address & 0x07);
+            block_cache->code_map[(address + 1) >> 3] |=
+                1 << ((address + 1) & 0x07);
+            length++;
+            address += 2;
+
+            if (cpu_block_terminator(instruction_type)) {
+                break;
+            }
+        }
+
+        block->ops[length].handler = &&block_exit;
+        block->generation = block_cache->generation;
+        block->start = cpu->pc;
+        block->length = length;
+        block->hotness = 0;
+        block->native_length = 0;
+        block->native = NULL;
+    }
+
+    if (cpu->engine == CPU_ENGINE_JIT && block->native == NULL &&
+        ++block->hotness == JIT_HOT_THRESHOLD)
+    {
+        cpu_compile_block(cpu, block);
+    }
+
+    //cut the block short by moving the sentinel in for this run
+    cpu_block_op_t *stop = NULL;
+    const void *stop_handler = NULL;
+    if (block->length > budget) {
+        stop = &block->ops[budget];
+        stop_handler = stop->handler;
+        stop->handler = &&block_exit;
+    }
+
+    //execute, starting with the native prefix if there is one
+    int error_code = 0;
+    cpu_block_op_t *op = block->ops;
+    cpu_block_op_t *counted = block->ops;
+    if (block->native != NULL && block->native_length <= budget) {
+        block->native(cpu);
+        op += block->native_length;
+    }
+    goto *op->handler;
+
+    OP_HANDLER(INSTRUCTION_SYS_NNN, cpu_exec_sys_nnn)
+    OP_HANDLER(INSTRUCTION_CLS, cpu_exec_cls)
+    OP_HANDLER(INSTRUCTION_RET, cpu_exec_ret)
+    OP_HANDLER(INSTRUCTION_JP_NNN, cpu_exec_jp_nnn)
+    OP_HANDLER(INSTRUCTION_CALL_NNN, cpu_exec_call_nnn)
+    OP_HANDLER(INSTRUCTION_SE_VX_KK, cpu_exec_se_vx_kk)
+    OP_HANDLER(INSTRUCTION_SNE_VX_KK, cpu_exec_sne_vx_kk)
+    OP_HANDLER(INSTRUCTION_SE_VX_VY, cpu_exec_se_vx_vy)
+    OP_HANDLER(INSTRUCTION_LD_VX_KK, cpu_exec_ld_vx_kk)
+    OP_HANDLER(INSTRUCTION_ADD_VX_KK, cpu_exec_add_vx_kk)
+    OP_HANDLER(INSTRUCTION_LD_VX_VY, cpu_exec_ld_vx_vy)
+    OP_HANDLER(INSTRUCTION_OR_VX_VY, cpu_exec_or_vx_vy)
+    OP_HANDLER(INSTRUCTION_AND_VX_VY, cpu_exec_and_vx_vy)
+    OP_HANDLER(INSTRUCTION_XOR_VX_VY, cpu_exec_xor_vx_vy)
+    OP_HANDLER(INSTRUCTION_ADD_VX_VY, cpu_exec_add_vx_vy)
+    OP_HANDLER(INSTRUCTION_SUB_VX_VY, cpu_exec_sub_vx_vy)
+    OP_HANDLER(INSTRUCTION_SHR_VX_VY, cpu_exec_shr_vx_vy)
+    OP_HANDLER(INSTRUCTION_SUBN_VX_VY, cpu_exec_subn_vx_vy)
+    OP_HANDLER(INSTRUCTION_SHL_VX_VY, cpu_exec_shl_vx_vy)
+    OP_HANDLER(INSTRUCTION_SNE_VX_VY, cpu_exec_sne_vx_vy)
+    OP_HANDLER(INSTRUCTION_LD_I_NNN, cpu_exec_ld_i_nnn)
+    OP_HANDLER(INSTRUCTION_JP_V0_NNN, cpu_exec_jp_v0_nnn)
+    OP_HANDLER(INSTRUCTION_RND_VX_KK, cpu_exec_rnd_vx_kk)
+    OP_HANDLER(INSTRUCTION_DRW_VX_VY_N, cpu_exec_drw_vx_vy_n)
+    KEY_OP_HANDLER(INSTRUCTION_SKP_VX, cpu_exec_skp_vx)
+    KEY_OP_HANDLER(INSTRUCTION_SKNP_VX, cpu_exec_sknp_vx)
+    OP_HANDLER(INSTRUCTION_LD_VX_DT, cpu_exec_ld_vx_dt)
+    KEY_OP_HANDLER(INSTRUCTION_LD_VX_K, cpu_exec_ld_vx_k)
+    OP_HANDLER(INSTRUCTION_LD_DT_VX, cpu_exec_ld_dt_vx)
+    OP_HANDLER(INSTRUCTION_LD_ST_VX, cpu_exec_ld_st_vx)
+    OP_HANDLER(INSTRUCTION_ADD_I_VX, cpu_exec_add_i_vx)
+    OP_HANDLER(INSTRUCTION_LD_F_VX, cpu_exec_ld_f_vx)
+    OP_HANDLER(INSTRUCTION_LD_B_VX, cpu_exec_ld_b_vx)
+    OP_HANDLER(INSTRUCTION_LD_I_VX, cpu_exec_ld_i_vx)
+    OP_HANDLER(INSTRUCTION_LD_VX_I, cpu_exec_ld_vx_i)
+    OP_HANDLER(INSTRUCTION_DATA, cpu_exec_data)
+
+block_exit:
+    cpu->instruction_count += op - counted;
+
+    if (stop != NULL) {
+        stop->handler = stop_handler;
+    }
+
+    #undef OP_HANDLER
+    #undef KEY_OP_HANDLER
+
+    return error_code;
+}
+
+static void cpu_compile_block(cpu_t *cpu, cpu_block_t *block) {
+    instruction_t instructions[BLOCK_MAX_LENGTH];
+    for (uint16_t i = 0; i < block->length; i++) {
+        instructions[i] = block->ops[i].instruction;
+    }
+
+    size_t length = jit_compilable(instructions, block->length);
+    if (length < JIT_MIN_LENGTH) {
+        return;
+    }
+
+    jit_code_t native = jit_compile(cpu->jit, instructions, length,
+                                    block->start);
+    if (native == NULL) {
+        //code buffer is full: drop every block along with its native code,
+        //this one stays usable until it is looked up again
+        cpu_flush_blocks(cpu);
+        return;
+    }
+
+    block->native = native;
+    block->native_length = length;
+}
+
+//drops every cached block and the native code compiled for them
+static void cpu_flush_blocks(cpu_t *cpu) {
+    cpu_block_cache_t *block_cache = cpu->block_cache;
+    block_cache->generation++;
+    memset(block_cache->code_map, 0, sizeof(block_cache->code_map));
+    jit_flush(cpu->jit);
+}
+
 static int cpu_exec_sys_nnn(cpu_t *cpu, const instruction_t *instruction) {
     //instruction ignored by modern interpreters
     return 0;
 }
 
 static int cpu_exec_cls(cpu_t *cpu, const instruction_t *instruction) {
-    for (int i = 0; i < DISPLAY_WIDTH; i++) {
-        for (int j = 0; j < DISPLAY_HEIGHT; j++) {
-            cpu->cpu_io_interface->draw_pixel(i, j, false);
+    for (uint8_t i = 0; i < DISPLAY_HEIGHT; i++) {
+        if (cpu->display[i]) {
+            cpu->dirty_rows |= 1U << i;
         }
     }
+    memset(cpu->display, 0, sizeof(cpu->display));
 
+    cpu->drawn = true;
     cpu->pc += 2;
 
     return 0;
@@ -505,7 +1553,7 @@ static int cpu_exec_jp_v0_nnn(cpu_t *cpu, const instruction_t *instruction) {
 //set Vx = random byte and kk
 static int cpu_exec_rnd_vx_kk(cpu_t *cpu, const instruction_t *instruction) {
     cpu->registers[instruction->operands[0]] = 
-        (rand() & 0xFF) & instruction->operands[1];
+        cpu_random_next(&cpu->random_state) & instruction->operands[1];
 
     cpu->pc += 2;
 
@@ -514,42 +1562,35 @@ static int cpu_exec_rnd_vx_kk(cpu_t *cpu, const instruction_t *instruction) {
 
 //display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
 static int cpu_exec_drw_vx_vy_n(cpu_t *cpu, const instruction_t *instruction) {
-    //sprite coordinates
-    uint8_t x = cpu->registers[instruction->operands[0]];
+    //sprite coordinates, wrapping around the screen
+    uint8_t x = cpu->registers[instruction->operands[0]] % DISPLAY_WIDTH;
     uint8_t y = cpu->registers[instruction->operands[1]];
 
     cpu->registers[0x0F] = 0;
 
     //for each byte of n-byte sprite
     for (uint16_t i = 0; i < instruction->operands[2]; i++) {
-        uint8_t display_state = 0x00;
-        for (uint8_t j = 0; j < SPRITE_WIDTH; j++) {
-            display_state <<= 1;
-            if (cpu->cpu_io_interface->get_pixel((x + j) % DISPLAY_WIDTH,
-                                                 (y + i) % DISPLAY_HEIGHT)) {
-                display_state |= 1;
-            }
-        }
-
-        if (display_state & cpu->memory[cpu->I + i]) {
+        //line the sprite byte up with pixel x, rotating whatever passes
+        //the right edge back around to the left
+        uint64_t sprite_row = (uint64_t)cpu_read_memory(cpu, cpu->I + i) <<
+                              (DISPLAY_WIDTH - SPRITE_WIDTH);
+        sprite_row = (sprite_row >> x) |
+                     (sprite_row << ((DISPLAY_WIDTH - x) % DISPLAY_WIDTH));
+
+        uint8_t row = (y + i) % DISPLAY_HEIGHT;
+        uint64_t *display_row = &cpu->display[row];
+        if (*display_row & sprite_row) {
             cpu->registers[0x0F] = 1;
         }
 
         //XOR onto existing screen
-        display_state ^= cpu->memory[cpu->I + i];
-        for (uint8_t j = 0; j < SPRITE_WIDTH; j++) {
-            if (display_state & (0x01 << (7 - j))) {
-                cpu->cpu_io_interface->draw_pixel((x + j) % DISPLAY_WIDTH,
-                                                  (y + i) % DISPLAY_HEIGHT,
-                                                  true);
-            } else {
-                cpu->cpu_io_interface->draw_pixel((x + j) % DISPLAY_WIDTH,
-                                                  (y + i) % DISPLAY_HEIGHT,
-                                                  false);
-            }
+        *display_row ^= sprite_row;
+        if (sprite_row) {
+            cpu->dirty_rows |= 1U << row;
         }
     }
 
+    cpu->drawn = true;
     cpu->pc += 2;
 
     return 0;
@@ -564,7 +1605,7 @@ static int cpu_exec_skp_vx(cpu_t *cpu, const instruction_t *instruction) {
 
     uint16_t bitmask = 1 << key_value;
 
-    uint16_t key_input = cpu->cpu_io_interface->get_keyboard();
+    uint16_t key_input = cpu->cpu_io_interface->get_keyboard(cpu->io_context);
     
     if (key_input & bitmask) {
         cpu->pc += 2;
@@ -584,7 +1625,7 @@ static int cpu_exec_sknp_vx(cpu_t *cpu, const instruction_t *instruction) {
 
     uint16_t bitmask = 1 << key_value;
 
-    uint16_t keyboard_state = cpu->cpu_io_interface->get_keyboard();
+    uint16_t keyboard_state = cpu->cpu_io_interface->get_keyboard(cpu->io_context);
 
     if (!(keyboard_state & bitmask)) {
         cpu->pc += 2;
@@ -606,7 +1647,7 @@ static int cpu_exec_ld_vx_dt(cpu_t *cpu, const instruction_t *instruction) {
 
 //wait for a key press, store the value of the key in Vx
 static int cpu_exec_ld_vx_k(cpu_t *cpu, const instruction_t *instruction) {
-    uint8_t key = cpu->cpu_io_interface->wait_keypress();
+    uint8_t key = cpu->cpu_io_interface->wait_keypress(cpu->io_context);
 
     cpu->registers[instruction->operands[0]] = key;
 
@@ -639,7 +1680,10 @@ static int cpu_exec_add_i_vx(cpu_t *cpu, const instruction_t *instruction) {
         return CPU_ERROR_WRITE_OOB;
     }
 
-    cpu->I += cpu->registers[instruction->operands[1]];
+    //wrapped like every memory access through I, so a saved state always
+    //holds an I below MEMORY_SIZE
+    cpu->I = (cpu->I + cpu->registers[instruction->operands[1]]) %
+             MEMORY_SIZE;
     cpu->pc += 2;
     
     return 0;
@@ -666,11 +1710,17 @@ static int cpu_exec_ld_b_vx(cpu_t *cpu, const instruction_t *instruction) {
 
     uint8_t decimal = cpu->registers[instruction->operands[1]];
 
-    cpu->memory[cpu->I + 2] = decimal % 10;
-    decimal /= 10;
-    cpu->memory[cpu->I + 1] = decimal % 10;
-    decimal /= 10;
-    cpu->memory[cpu->I] = decimal % 10;
+    //pages shared with a clone are copied before the first byte changes,
+    //so running out of memory leaves the cpu as it was
+    if (cpu_own_range(cpu, cpu->I, 3)) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
+    cpu_write_memory(cpu, cpu->I, decimal / 100 % 10);
+    cpu_write_memory(cpu, cpu->I + 1, decimal / 10 % 10);
+    cpu_write_memory(cpu, cpu->I + 2, decimal % 10);
+
+    cpu_invalidate_code(cpu, cpu->I, 3);
 
     cpu->pc += 2;
 
@@ -683,10 +1733,16 @@ static int cpu_exec_ld_i_vx(cpu_t *cpu, const instruction_t *instruction) {
         return CPU_ERROR_WRITE_OOB;
     }
 
+    if (cpu_own_range(cpu, cpu->I, instruction->operands[1] + 1)) {
+        return CPU_ERROR_NULL_PNTR;
+    }
+
     for (uint16_t i = 0; i <= instruction->operands[1]; i++) {
-        cpu->memory[cpu->I + i] = cpu->registers[i];
+        cpu_write_memory(cpu, cpu->I + i, cpu->registers[i]);
     }
 
+    cpu_invalidate_code(cpu, cpu->I, instruction->operands[1] + 1);
+
     cpu->pc += 2;
 
     return 0;
@@ -695,7 +1751,7 @@ static int cpu_exec_ld_i_vx(cpu_t *cpu, const instruction_t *instruction) {
 //read registers V0 through Vx from memory starting at location I
 static int cpu_exec_ld_vx_i(cpu_t *cpu, const instruction_t *instruction) {
     for (uint16_t i = 0; i <= instruction->operands[0]; i++) {
-         cpu->registers[i] = cpu->memory[cpu->I + i];
+         cpu->registers[i] = cpu_read_memory(cpu, cpu->I + i);
     }
 
     cpu->pc += 2;
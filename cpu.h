@@ -6,33 +6,106 @@
 
 #define DISPLAY_WIDTH 64        //x coordinate
 #define DISPLAY_HEIGHT 32       //y coordinate
+#define FONT_SPRITE_HEIGHT 5
+#define FONT_LIBRARY_SIZE (16 * FONT_SPRITE_HEIGHT)
 
 typedef struct cpu cpu_t;
+typedef struct cpu_pool cpu_pool_t;
+
+//the codes methods returning int report, see the notes at the end
+enum cpu_error_code {
+    CPU_ERROR_SUCCESS          =  0,    //success
+    CPU_ERROR_NULL_PNTR        = -1,    //NULL pointer returned
+    CPU_ERROR_8BIT_OOB         = -2,    //value exceeds 0x0F
+    CPU_ERROR_PC_OOB           = -3,    //pc set to memory address < 0x2
+    CPU_ERROR_WRITE_OOB        = -4,    //attempted write to memory addr
+    CPU_ERROR_STACK_UNDERFLOW  = -5,    //stack underflow
+    CPU_ERROR_STACK_OVERFLOW   = -6,    //stack overflow
+    CPU_ERROR_DATA_EXEC        = -7,    //data opcode ran as executable
+    CPU_ERROR_UNSUPORTED       = -8,    //unsupported opcode ran as executable
+    CPU_ERROR_STATE            = -9     //state buffer too small or invalid
+};
+
+typedef enum cpu_engine {
+    CPU_ENGINE_INTERPRETER,     //decode and dispatch one instruction at a time
+    CPU_ENGINE_THREADED,        //run cached blocks with threaded dispatch
+    CPU_ENGINE_JIT              //threaded, plus native x86-64 for hot blocks
+} cpu_engine_t;
+
+typedef enum cpu_stop_reason {
+    CPU_STOP_CYCLES,            //max_cycles instructions executed
+    CPU_STOP_KEY_WAIT,          //next instruction waits for a key press
+    CPU_STOP_DRAW,              //screen cleared or sprite drawn
+    CPU_STOP_IDLE,              //spinning in a loop that only polls DT or
+                                //the keys, the rest of the frame can be
+                                //skipped
+    CPU_STOP_ERROR              //instruction failed, see error_code
+} cpu_stop_reason_t;
+
+typedef struct cpu_run_result {
+    cpu_stop_reason_t stop_reason;
+    uint32_t cycles;            //instructions executed
+    int error_code;
+} cpu_run_result_t;
 
 typedef struct cpu_io_interface {
+    //every callback receives the context pointer given to cpu_new, so one
+    //backend can serve any number of cpus
+
     //for hexadecimal keyboard input:
     //  16th bit -> f           1 - key pressed
     //   |          |           0 - key not pressed
     //   1st bit -> 0
-    uint16_t (*get_keyboard)();
+    uint16_t (*get_keyboard)(void *context);
 
-    uint8_t (*wait_keypress)();
+    uint8_t (*wait_keypress)(void *context);
 
-    bool (*get_pixel)(uint8_t x, uint8_t y);    
-    void (*draw_pixel)(uint8_t x, uint8_t y, bool fill);
+    //called from cpu_present with the whole screen, one row per element:
+    //  bit 63 -> x = 0
+    //   |
+    //  bit 0  -> x = 63
+    //and a mask of the rows changed since the previous call, bit y -> row y
+    void (*present_frame)(void *context,
+                          const uint64_t display[DISPLAY_HEIGHT],
+                          uint32_t dirty_rows);
 } cpu_io_interface_t;
 
-cpu_t *cpu_new(const cpu_io_interface_t *cpu_io_interface);
+cpu_t *cpu_new(const cpu_io_interface_t *cpu_io_interface, void *io_context);
 int cpu_load(cpu_t *cpu, const rombuffer_t *rom);
 int cpu_reset(cpu_t *cpu, const rombuffer_t *rom);
+int cpu_set_fast_reset(cpu_t *cpu, bool enabled);
+int cpu_reset_fast(cpu_t *cpu);
+int cpu_set_engine(cpu_t *cpu, cpu_engine_t engine);
+int cpu_set_seed(cpu_t *cpu, uint64_t seed);
 int cpu_execute(cpu_t *cpu);
+int cpu_run(cpu_t *cpu, uint32_t max_cycles, cpu_run_result_t *result);
+int cpu_present(cpu_t *cpu);
+bool cpu_key_wait_pending(cpu_t *cpu);
+uint64_t cpu_get_instruction_count(const cpu_t *cpu);
+uint8_t cpu_peek(const cpu_t *cpu, uint16_t address);
+size_t cpu_state_size();
+int cpu_save_state(const cpu_t *cpu, void *buffer, size_t size);
+int cpu_load_state(cpu_t *cpu, const void *buffer, size_t size);
 int cpu_decrement_timers(cpu_t *cpu);
 void cpu_free(cpu_t *cpu);
 
+//the font and generator every engine shares, for machines that keep their
+//own state such as cpu_soa
+extern const uint8_t cpu_font_library[FONT_LIBRARY_SIZE];
+uint64_t cpu_random_init(uint64_t seed);
+uint8_t cpu_random_next(uint64_t *random_state);
+
+//clones share memory in 256 byte pages, copied on the first write to one.
+//a cpu, its clones and their pool must be used from one thread at a time
+cpu_pool_t *cpu_pool_new();
+cpu_t *cpu_clone(const cpu_t *cpu, cpu_pool_t *pool);
+void cpu_pool_free(cpu_pool_t *pool);
+
 //for methods returning int:
 //       1 - program terminated with keyboard input
 //       0 - success
-//      -1 - pointer is NULL
+//      -1 - pointer is NULL, or no memory to copy a page shared with a
+//           clone
 //
 //    abort errors returned from cpu_exec functions:
 //      -2 - value exceeds 0x0F
@@ -41,3 +114,23 @@ void cpu_free(cpu_t *cpu);
 //      -5 - stack underflow
 //      -6 - stack overflow
 //      -7 - attempted execution of data
+//
+//    returned from cpu_save_state and cpu_load_state:
+//      -9 - buffer smaller than cpu_state_size, not a saved state or with
+//           sp, I or the random state out of range
+//    returned from cpu_reset_fast:
+//      -9 - no cpu_load or cpu_reset since fast reset was enabled
+//
+//cpu_clone copies everything but the engine: a clone starts on
+//CPU_ENGINE_INTERPRETER. with a NULL pool it is malloc'd, otherwise
+//cpu_free hands it and the pages it dropped back to the pool for reuse,
+//so cpu_pool_free must come after every cpu cloned into it is freed.
+//memory addresses wrap around at 4 KB
+//
+//with fast reset enabled, cpu_load and cpu_reset keep the memory image
+//they produce, shared with the cpu until a write copies a page. the cost
+//of cpu_reset_fast then grows with the pages and rows the run touched,
+//not with the whole machine. the seed is applied as by cpu_reset
+//
+//save states are fixed size blobs in host byte order, written and read
+//in place. loading only allocates to copy pages shared with a clone
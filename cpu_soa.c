@@ -0,0 +1,764 @@
+//cpu_soa.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rombuffer.h"
+#include "disassembler.h"
+#include "cpu.h"
+#include "cpu_soa.h"
+
+#define LANES CPU_SOA_MAX_LANES
+#define SPRITE_WIDTH 8
+#define MEMORY_SIZE 4096
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+#define DECODE_CACHE_SIZE (MEMORY_SIZE / 2)
+
+//the vector loops run over all LANES lanes and select the results of the
+//lanes in a group, which compiles to plain SIMD. x86-64 builds also get an
+//AVX2 copy of the interpreter, picked at load time
+#if defined(__x86_64__)
+#define CPU_SOA_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define CPU_SOA_TARGETS
+#endif
+
+typedef struct cpu_soa {
+    uint32_t lane_count;
+    uint32_t lanes;                     //mask of lanes in use
+    uint32_t halted;                    //lanes stopped by an error
+    uint32_t written;                   //lanes that stored to memory
+
+    //one row per field, one column per lane
+    _Alignas(32) uint8_t registers[16][LANES];
+    _Alignas(32) uint16_t I[LANES];
+    _Alignas(32) uint16_t pc[LANES];
+    _Alignas(32) uint8_t DT[LANES];
+    _Alignas(32) uint8_t ST[LANES];
+    _Alignas(32) uint8_t sp[LANES];
+    _Alignas(32) uint16_t stack[16][LANES];
+    _Alignas(32) uint16_t keys[LANES];
+
+    uint64_t instruction_count[LANES];
+    uint64_t seed[LANES];
+    uint64_t random_state[LANES];
+    int error_code[LANES];
+
+    uint64_t display[LANES][DISPLAY_HEIGHT];
+    uint8_t memory[LANES][MEMORY_SIZE];
+
+    //shared by the lanes, an entry is valid for the opcode it was decoded
+    //from so self-modifying lanes never see a stale one
+    instruction_t decode_cache[DECODE_CACHE_SIZE];
+    uint16_t decode_opcode[DECODE_CACHE_SIZE];
+
+    cpu_soa_stats_t stats;
+} cpu_soa_t;
+
+static uint32_t cpu_soa_group(cpu_soa_t *cpu_soa, uint32_t pending,
+                              uint16_t *opcode);
+static const instruction_t *cpu_soa_decode(cpu_soa_t *cpu_soa, uint16_t pc,
+                                           uint16_t opcode,
+                                           instruction_t *scratch);
+static uint32_t cpu_soa_exec(cpu_soa_t *cpu_soa, uint32_t group,
+                             const instruction_t *instruction);
+static void cpu_soa_fail(cpu_soa_t *cpu_soa, uint32_t lanes, int error_code);
+static void cpu_soa_lane_mask(uint32_t group, uint8_t m8[LANES],
+                              uint16_t m16[LANES]);
+static void cpu_soa_store8(uint8_t row[LANES], const uint8_t value[LANES],
+                           const uint8_t m8[LANES]);
+static void cpu_soa_store16(uint16_t row[LANES], const uint16_t value[LANES],
+                            const uint16_t m16[LANES]);
+static void cpu_soa_skip(cpu_soa_t *cpu_soa, const uint8_t skip[LANES],
+                         const uint16_t m16[LANES]);
+static void cpu_soa_drw(cpu_soa_t *cpu_soa, uint32_t lane,
+                        const instruction_t *instruction);
+
+cpu_soa_t *cpu_soa_new(uint32_t lane_count) {
+    if (lane_count == 0 || lane_count > LANES) {
+        return NULL;
+    }
+
+    cpu_soa_t *cpu_soa = aligned_alloc(32, (sizeof(cpu_soa_t) + 31) & ~31);
+    if (cpu_soa == NULL) {
+        return NULL;
+    }
+    memset(cpu_soa, 0, sizeof(cpu_soa_t));
+
+    cpu_soa->lane_count = lane_count;
+    cpu_soa->lanes = lane_count == 32 ? UINT32_MAX : (1u << lane_count) - 1;
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        cpu_soa->random_state[lane] = cpu_random_init(0);
+    }
+
+    return cpu_soa;
+}
+
+int cpu_soa_load(cpu_soa_t *cpu_soa, const rombuffer_t *rom) {
+    if (cpu_soa == NULL || rom == NULL) {
+        return -1;
+    }
+
+    memset(cpu_soa->registers, 0, sizeof(cpu_soa->registers));
+    memset(cpu_soa->I, 0, sizeof(cpu_soa->I));
+    memset(cpu_soa->DT, 0, sizeof(cpu_soa->DT));
+    memset(cpu_soa->ST, 0, sizeof(cpu_soa->ST));
+    memset(cpu_soa->sp, 0, sizeof(cpu_soa->sp));
+    memset(cpu_soa->stack, 0, sizeof(cpu_soa->stack));
+    memset(cpu_soa->instruction_count, 0,
+           sizeof(cpu_soa->instruction_count));
+    memset(cpu_soa->error_code, 0, sizeof(cpu_soa->error_code));
+    memset(cpu_soa->display, 0, sizeof(cpu_soa->display));
+    memset(cpu_soa->decode_cache, 0, sizeof(cpu_soa->decode_cache));
+    memset(&cpu_soa->stats, 0, sizeof(cpu_soa->stats));
+    cpu_soa->halted = 0;
+    cpu_soa->written = 0;
+
+    //every lane starts from the same image
+    uint8_t *image = cpu_soa->memory[0];
+    memset(image, 0, MEMORY_SIZE);
+    memcpy(image, cpu_font_library, FONT_LIBRARY_SIZE);
+    for (size_t i = 0; i < rom->length && 0x200 + i * 2 + 1 < MEMORY_SIZE;
+         i++)
+    {
+        image[0x200 + (i * 2)] = (uint8_t)((rom->data[i] & 0xFF00) >> 8);
+        image[0x200 + (i * 2) + 1] = (uint8_t)(rom->data[i] & 0x00FF);
+    }
+
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        if (lane > 0) {
+            memcpy(cpu_soa->memory[lane], image, MEMORY_SIZE);
+        }
+        cpu_soa->pc[lane] = 0x200;
+        cpu_soa->random_state[lane] =
+            cpu_random_init(cpu_soa->seed[lane]);
+    }
+
+    return 0;
+}
+
+//restarts RND of a lane from seed, as cpu_set_seed
+int cpu_soa_set_seed(cpu_soa_t *cpu_soa, uint32_t lane, uint64_t seed) {
+    if (cpu_soa == NULL || lane >= cpu_soa->lane_count) {
+        return -1;
+    }
+
+    cpu_soa->seed[lane] = seed;
+    cpu_soa->random_state[lane] = cpu_random_init(seed);
+
+    return 0;
+}
+
+//key mask of a lane, laid out as for get_keyboard
+int cpu_soa_set_keys(cpu_soa_t *cpu_soa, uint32_t lane, uint16_t keys) {
+    if (cpu_soa == NULL || lane >= cpu_soa->lane_count) {
+        return -1;
+    }
+
+    cpu_soa->keys[lane] = keys;
+
+    return 0;
+}
+
+CPU_SOA_TARGETS
+int cpu_soa_run(cpu_soa_t *cpu_soa, uint32_t cycles) {
+    if (cpu_soa == NULL) {
+        return -1;
+    }
+
+    for (uint32_t cycle = 0; cycle < cycles; cycle++) {
+        uint32_t pending = cpu_soa->lanes & ~cpu_soa->halted;
+        if (pending == 0) {
+            break;
+        }
+
+        cpu_soa->stats.steps++;
+
+        //split the lanes into groups sharing pc and opcode, each group
+        //executes this step's instruction together
+        while (pending) {
+            uint16_t opcode;
+            uint32_t group = cpu_soa_group(cpu_soa, pending, &opcode);
+            pending &= ~group;
+
+            instruction_t scratch;
+            const instruction_t *instruction =
+                cpu_soa_decode(cpu_soa, cpu_soa->pc[__builtin_ctz(group)],
+                               opcode, &scratch);
+
+            uint32_t executed = cpu_soa_exec(cpu_soa, group, instruction);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                cpu_soa->instruction_count[lane] += (executed >> lane) & 1;
+            }
+
+            cpu_soa->stats.groups++;
+        }
+    }
+
+    return 0;
+}
+
+CPU_SOA_TARGETS
+int cpu_soa_decrement_timers(cpu_soa_t *cpu_soa) {
+    if (cpu_soa == NULL) {
+        return -1;
+    }
+
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        cpu_soa->DT[lane] -= cpu_soa->DT[lane] > 0;
+        cpu_soa->ST[lane] -= cpu_soa->ST[lane] > 0;
+    }
+
+    return 0;
+}
+
+//display of a lane, laid out as for present_frame
+int cpu_soa_get_display(const cpu_soa_t *cpu_soa, uint32_t lane,
+                        uint64_t display[DISPLAY_HEIGHT]) {
+    if (cpu_soa == NULL || display == NULL || lane >= cpu_soa->lane_count) {
+        return -1;
+    }
+
+    memcpy(display, cpu_soa->display[lane], sizeof(cpu_soa->display[0]));
+
+    return 0;
+}
+
+uint64_t cpu_soa_get_instruction_count(const cpu_soa_t *cpu_soa,
+                                       uint32_t lane) {
+    if (cpu_soa == NULL || lane >= cpu_soa->lane_count) {
+        return 0;
+    }
+
+    return cpu_soa->instruction_count[lane];
+}
+
+int cpu_soa_get_error(const cpu_soa_t *cpu_soa, uint32_t lane) {
+    if (cpu_soa == NULL || lane >= cpu_soa->lane_count) {
+        return -1;
+    }
+
+    return cpu_soa->error_code[lane];
+}
+
+void cpu_soa_get_stats(const cpu_soa_t *cpu_soa, cpu_soa_stats_t *stats) {
+    *stats = cpu_soa->stats;
+}
+
+void cpu_soa_free(cpu_soa_t *cpu_soa) {
+    free(cpu_soa);
+}
+
+//the pending lanes at the pc of the first one that also hold the same
+//opcode there. pc may run past the end of memory, it wraps like every
+//fetch in cpu.c
+static uint32_t cpu_soa_group(cpu_soa_t *cpu_soa, uint32_t pending,
+                              uint16_t *opcode) {
+    uint32_t leader = __builtin_ctz(pending);
+    uint16_t pc = cpu_soa->pc[leader] & MEMORY_MASK;
+
+    uint32_t group = 0;
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        group |= (uint32_t)((cpu_soa->pc[lane] & MEMORY_MASK) == pc) << lane;
+    }
+    group &= pending;
+
+    const uint8_t *code = &cpu_soa->memory[leader][pc];
+    *opcode = (code[0] << 8) | cpu_soa->memory[leader][(pc + 1) & MEMORY_MASK];
+
+    //lanes that never stored still hold the loaded image, only compare
+    //against the ones that did
+    uint32_t check = group & ~(1u << leader);
+    if (!(cpu_soa->written & (1u << leader))) {
+        check &= cpu_soa->written;
+    }
+
+    for (uint32_t lanes = check; lanes; lanes &= lanes - 1) {
+        uint32_t lane = __builtin_ctz(lanes);
+        if (cpu_soa->memory[lane][pc] != code[0] ||
+            cpu_soa->memory[lane][(pc + 1) & MEMORY_MASK] !=
+            (*opcode & 0xFF))
+        {
+            group &= ~(1u << lane);
+        }
+    }
+
+    return group;
+}
+
+static const instruction_t *cpu_soa_decode(cpu_soa_t *cpu_soa, uint16_t pc,
+                                           uint16_t opcode,
+                                           instruction_t *scratch) {
+    pc &= MEMORY_MASK;
+    if (pc & 0x01) {
+        disassembler_disassemble(scratch, opcode);
+        return scratch;
+    }
+
+    instruction_t *instruction = &cpu_soa->decode_cache[pc >> 1];
+    if (instruction->instruction_info == NULL ||
+        cpu_soa->decode_opcode[pc >> 1] != opcode)
+    {
+        disassembler_disassemble(instruction, opcode);
+        cpu_soa->decode_opcode[pc >> 1] = opcode;
+    }
+
+    return instruction;
+}
+
+//executes instruction on every lane of group, mirroring the cpu_exec
+//functions of cpu.c. returns the lanes that completed it, the others
+//failed or are stalled in a key wait
+static inline __attribute__((always_inline))
+uint32_t cpu_soa_exec(cpu_soa_t *cpu_soa, uint32_t group,
+                      const instruction_t *instruction) {
+    const uint16_t *operands = instruction->operands;
+    uint8_t (*V)[LANES] = cpu_soa->registers;
+
+    _Alignas(32) uint8_t m8[LANES];
+    _Alignas(32) uint16_t m16[LANES];
+    _Alignas(32) uint8_t value[LANES];
+    _Alignas(32) uint8_t flag[LANES];
+    _Alignas(32) uint16_t address[LANES];
+    cpu_soa_lane_mask(group, m8, m16);
+
+    uint8_t x = operands[0] & 0x0F;
+    uint8_t y = operands[1] & 0x0F;
+    uint32_t failed = 0;
+
+    switch (instruction->instruction_info->instruction_type) {
+        case INSTRUCTION_SYS_NNN:
+            //ignored without advancing pc, as in cpu.c
+            break;
+
+        case INSTRUCTION_CLS:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                memset(cpu_soa->display[__builtin_ctz(lanes)], 0,
+                       sizeof(cpu_soa->display[0]));
+            }
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_RET:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                uint8_t sp = cpu_soa->sp[lane];
+                if (cpu_soa->stack[sp][lane] < 0x200) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_PC_OOB;
+                    continue;
+                }
+
+                cpu_soa->pc[lane] = cpu_soa->stack[sp][lane];
+                if (sp == 0) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_STACK_UNDERFLOW;
+                    continue;
+                }
+                cpu_soa->sp[lane]--;
+            }
+            break;
+
+        case INSTRUCTION_JP_NNN:
+            if (operands[0] < 0x200) {
+                cpu_soa_fail(cpu_soa, group, CPU_ERROR_PC_OOB);
+                return 0;
+            }
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                address[lane] = operands[0];
+            }
+            cpu_soa_store16(cpu_soa->pc, address, m16);
+            break;
+
+        case INSTRUCTION_CALL_NNN:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                if (cpu_soa->sp[lane] == 15) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_STACK_OVERFLOW;
+                    continue;
+                }
+
+                cpu_soa->sp[lane]++;
+                cpu_soa->stack[cpu_soa->sp[lane]][lane] = cpu_soa->pc[lane] + 2;
+                if (operands[0] < 0x200) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_PC_OOB;
+                    continue;
+                }
+                cpu_soa->pc[lane] = operands[0];
+            }
+            break;
+
+        case INSTRUCTION_SE_VX_KK:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] == operands[1];
+            }
+            cpu_soa_skip(cpu_soa, flag, m16);
+            break;
+
+        case INSTRUCTION_SNE_VX_KK:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] != operands[1];
+            }
+            cpu_soa_skip(cpu_soa, flag, m16);
+            break;
+
+        case INSTRUCTION_SE_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] == V[y][lane];
+            }
+            cpu_soa_skip(cpu_soa, flag, m16);
+            break;
+
+        case INSTRUCTION_SNE_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] != V[y][lane];
+            }
+            cpu_soa_skip(cpu_soa, flag, m16);
+            break;
+
+        case INSTRUCTION_LD_VX_KK:
+            memset(value, operands[1], LANES);
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_ADD_VX_KK:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] + operands[1];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_LD_VX_VY:
+            memcpy(value, V[y], LANES);
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_OR_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] | V[y][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_AND_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] & V[y][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_XOR_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] ^ V[y][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        //the flag is written before the result, which then reads the
+        //flag when x or y is F, as in cpu.c
+        case INSTRUCTION_ADD_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] + V[y][lane] > 0xFF;
+            }
+            cpu_soa_store8(V[0x0F], flag, m8);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] + V[y][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_SUB_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] > V[y][lane];
+            }
+            cpu_soa_store8(V[0x0F], flag, m8);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] - V[y][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_SHR_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] & 0x01;
+            }
+            cpu_soa_store8(V[0x0F], flag, m8);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] >> 1;
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_SUBN_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[y][lane] > V[x][lane];
+            }
+            cpu_soa_store8(V[0x0F], flag, m8);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[y][lane] - V[x][lane];
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_SHL_VX_VY:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                flag[lane] = V[x][lane] & 0x80;
+            }
+            cpu_soa_store8(V[0x0F], flag, m8);
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                value[lane] = V[x][lane] << 1;
+            }
+            cpu_soa_store8(V[x], value, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_LD_I_NNN:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                address[lane] = operands[1];
+            }
+            cpu_soa_store16(cpu_soa->I, address, m16);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_JP_V0_NNN:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                uint16_t target = operands[1] + V[0][lane];
+                if (target < 0x200) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_PC_OOB;
+                    continue;
+                }
+                cpu_soa->pc[lane] = target;
+            }
+            break;
+
+        case INSTRUCTION_RND_VX_KK:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                V[x][lane] = cpu_random_next(&cpu_soa->random_state[lane]) &
+                             operands[1];
+            }
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_DRW_VX_VY_N:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                cpu_soa_drw(cpu_soa, __builtin_ctz(lanes), instruction);
+            }
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_SKP_VX:
+        case INSTRUCTION_SKNP_VX: {
+            bool pressed = instruction->instruction_info->instruction_type ==
+                           INSTRUCTION_SKP_VX;
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                uint8_t key = V[x][lane];
+                flag[lane] = ((cpu_soa->keys[lane] >> (key & 0x0F)) & 1) ==
+                             pressed;
+                failed |= (uint32_t)(key > 0x0F) << lane;
+            }
+            failed &= group;
+            cpu_soa_fail(cpu_soa, failed, CPU_ERROR_8BIT_OOB);
+            cpu_soa_lane_mask(group & ~failed, m8, m16);
+            cpu_soa_skip(cpu_soa, flag, m16);
+            break;
+        }
+
+        case INSTRUCTION_LD_VX_DT:
+            cpu_soa_store8(V[x], cpu_soa->DT, m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        //a lane without a key held stays on the instruction
+        case INSTRUCTION_LD_VX_K:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                if (cpu_soa->keys[lane] == 0) {
+                    group &= ~(1u << lane);
+                    continue;
+                }
+                V[x][lane] = __builtin_ctz(cpu_soa->keys[lane]);
+                cpu_soa->pc[lane] += 2;
+            }
+            return group;
+
+        case INSTRUCTION_LD_DT_VX:
+            cpu_soa_store8(cpu_soa->DT, V[y], m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_LD_ST_VX:
+            cpu_soa_store8(cpu_soa->ST, V[y], m8);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_ADD_I_VX:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                failed |= (uint32_t)(cpu_soa->I[lane] < 0x200) << lane;
+                address[lane] = (cpu_soa->I[lane] + V[y][lane]) &
+                                MEMORY_MASK;
+            }
+            failed &= group;
+            cpu_soa_fail(cpu_soa, failed, CPU_ERROR_WRITE_OOB);
+            cpu_soa_lane_mask(group & ~failed, m8, m16);
+            cpu_soa_store16(cpu_soa->I, address, m16);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_LD_F_VX:
+            for (uint32_t lane = 0; lane < LANES; lane++) {
+                failed |= (uint32_t)(V[y][lane] > 0x0F) << lane;
+                address[lane] = V[y][lane] * FONT_SPRITE_HEIGHT;
+            }
+            failed &= group;
+            cpu_soa_fail(cpu_soa, failed, CPU_ERROR_8BIT_OOB);
+            cpu_soa_lane_mask(group & ~failed, m8, m16);
+            cpu_soa_store16(cpu_soa->I, address, m16);
+            cpu_soa_skip(cpu_soa, NULL, m16);
+            break;
+
+        case INSTRUCTION_LD_B_VX:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                uint16_t I = cpu_soa->I[lane];
+                if (I < 0x200) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_WRITE_OOB;
+                    continue;
+                }
+
+                uint8_t decimal = V[y][lane];
+                uint8_t *memory = cpu_soa->memory[lane];
+                memory[(I + 2) & MEMORY_MASK] = decimal % 10;
+                decimal /= 10;
+                memory[(I + 1) & MEMORY_MASK] = decimal % 10;
+                decimal /= 10;
+                memory[I & MEMORY_MASK] = decimal % 10;
+                cpu_soa->written |= 1u << lane;
+                cpu_soa->pc[lane] += 2;
+            }
+            break;
+
+        case INSTRUCTION_LD_I_VX:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                uint16_t I = cpu_soa->I[lane];
+                if (I < 0x200) {
+                    failed |= 1u << lane;
+                    cpu_soa->error_code[lane] = CPU_ERROR_WRITE_OOB;
+                    continue;
+                }
+
+                for (uint16_t i = 0; i <= operands[1]; i++) {
+                    cpu_soa->memory[lane][(I + i) & MEMORY_MASK] = V[i][lane];
+                }
+                cpu_soa->written |= 1u << lane;
+                cpu_soa->pc[lane] += 2;
+            }
+            break;
+
+        case INSTRUCTION_LD_VX_I:
+            for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                uint32_t lane = __builtin_ctz(lanes);
+                uint16_t I = cpu_soa->I[lane];
+                for (uint16_t i = 0; i <= operands[0]; i++) {
+                    V[i][lane] = cpu_soa->memory[lane][(I + i) & MEMORY_MASK];
+                }
+                cpu_soa->pc[lane] += 2;
+            }
+            break;
+
+        case INSTRUCTION_DATA:
+        default:
+            cpu_soa_fail(cpu_soa, group, CPU_ERROR_DATA_EXEC);
+            return 0;
+    }
+
+    cpu_soa->halted |= failed;
+
+    return group & ~failed;
+}
+
+//stops lanes with error_code
+static void cpu_soa_fail(cpu_soa_t *cpu_soa, uint32_t lanes, int error_code) {
+    cpu_soa->halted |= lanes;
+    for (; lanes; lanes &= lanes - 1) {
+        cpu_soa->error_code[__builtin_ctz(lanes)] = error_code;
+    }
+}
+
+//all ones in the lanes of group, zero elsewhere
+static inline __attribute__((always_inline))
+void cpu_soa_lane_mask(uint32_t group, uint8_t m8[LANES],
+                       uint16_t m16[LANES]) {
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        m16[lane] = -(uint16_t)((group >> lane) & 1);
+        m8[lane] = m16[lane];
+    }
+}
+
+static inline __attribute__((always_inline))
+void cpu_soa_store8(uint8_t row[LANES], const uint8_t value[LANES],
+                    const uint8_t m8[LANES]) {
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        row[lane] = (value[lane] & m8[lane]) | (row[lane] & ~m8[lane]);
+    }
+}
+
+static inline __attribute__((always_inline))
+void cpu_soa_store16(uint16_t row[LANES], const uint16_t value[LANES],
+                     const uint16_t m16[LANES]) {
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        row[lane] = (value[lane] & m16[lane]) | (row[lane] & ~m16[lane]);
+    }
+}
+
+//advances pc past the instruction, and past the next one where skip is set
+static inline __attribute__((always_inline))
+void cpu_soa_skip(cpu_soa_t *cpu_soa, const uint8_t skip[LANES],
+                  const uint16_t m16[LANES]) {
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+        uint16_t step = skip != NULL ? 2 + 2 * skip[lane] : 2;
+        cpu_soa->pc[lane] += step & m16[lane];
+    }
+}
+
+static void cpu_soa_drw(cpu_soa_t *cpu_soa, uint32_t lane,
+                        const instruction_t *instruction) {
+    uint8_t (*V)[LANES] = cpu_soa->registers;
+    uint8_t x = V[instruction->operands[0]][lane] % DISPLAY_WIDTH;
+    uint8_t y = V[instruction->operands[1]][lane];
+    uint16_t I = cpu_soa->I[lane];
+
+    V[0x0F][lane] = 0;
+
+    for (uint16_t i = 0; i < instruction->operands[2]; i++) {
+        uint64_t sprite_row =
+            (uint64_t)cpu_soa->memory[lane][(I + i) & MEMORY_MASK] <<
+            (DISPLAY_WIDTH - SPRITE_WIDTH);
+        sprite_row = (sprite_row >> x) |
+                     (sprite_row << ((DISPLAY_WIDTH - x) % DISPLAY_WIDTH));
+
+        uint64_t *display_row =
+            &cpu_soa->display[lane][(y + i) % DISPLAY_HEIGHT];
+        if (*display_row & sprite_row) {
+            V[0x0F][lane] = 1;
+        }
+        *display_row ^= sprite_row;
+    }
+}
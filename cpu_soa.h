@@ -0,0 +1,38 @@
+//cpu_soa.h
+
+#pragma once
+
+#define CPU_SOA_MAX_LANES 32
+
+typedef struct cpu_soa cpu_soa_t;
+
+typedef struct cpu_soa_stats {
+    uint64_t steps;             //instructions issued per lane
+    uint64_t groups;            //instructions issued, one per group of
+                                //lanes sharing pc and opcode
+} cpu_soa_stats_t;
+
+//up to CPU_SOA_MAX_LANES independent machines running the same rom, with
+//their state stored per field across lanes. lanes whose pc and opcode
+//agree execute each instruction together, the ALU, skip and timer
+//instructions as vector operations over all lanes at once
+cpu_soa_t *cpu_soa_new(uint32_t lane_count);
+int cpu_soa_load(cpu_soa_t *cpu_soa, const rombuffer_t *rom);
+int cpu_soa_set_seed(cpu_soa_t *cpu_soa, uint32_t lane, uint64_t seed);
+int cpu_soa_set_keys(cpu_soa_t *cpu_soa, uint32_t lane, uint16_t keys);
+int cpu_soa_run(cpu_soa_t *cpu_soa, uint32_t cycles);
+int cpu_soa_decrement_timers(cpu_soa_t *cpu_soa);
+int cpu_soa_get_display(const cpu_soa_t *cpu_soa, uint32_t lane,
+                        uint64_t display[DISPLAY_HEIGHT]);
+uint64_t cpu_soa_get_instruction_count(const cpu_soa_t *cpu_soa,
+                                       uint32_t lane);
+int cpu_soa_get_error(const cpu_soa_t *cpu_soa, uint32_t lane);
+void cpu_soa_get_stats(const cpu_soa_t *cpu_soa, cpu_soa_stats_t *stats);
+void cpu_soa_free(cpu_soa_t *cpu_soa);
+
+//every lane behaves like a cpu_t on the interpreter engine, seeded and
+//fed keys the same way, except that a key wait without a key held stalls
+//the lane instead of blocking. cpu_soa_run issues cycles instructions to
+//every lane, a lane that fails stops with the cpu_error_code from cpu.h
+//that cpu_soa_get_error reports. cpu_soa_load resets every lane, seeds
+//are kept
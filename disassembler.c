@@ -2,11 +2,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "rombuffer.h"
 #include "disassembler.h"
 
 #define MAX_FORMATTED_OP_SIZE 6
 #define FORMATTED_INSTRUCTION_SIZE 20
+#define DECODE_TABLE_SIZE 0x10000        //one entry per 16 bit opcode
 
 static const uint16_t operand_masks[][2] = {
     [OPERAND_VX]    = {0x0F00, 8},        //x
@@ -36,7 +38,7 @@ static const instruction_info_t instruction_info_table[] = {
     },
     {
         INSTRUCTION_RET,
-        0x00FF,
+        0xFFFF,
         0x00EE,
         "RET",
         0,
@@ -311,6 +313,15 @@ static const instruction_info_t instruction_info_table[] = {
 static const size_t instruction_info_table_size =
     sizeof(instruction_info_table) / sizeof(instruction_info_table[0]);
 
+//every opcode decoded ahead of time, built on first use
+static instruction_t decode_table[DECODE_TABLE_SIZE];
+static pthread_once_t decode_table_once = PTHREAD_ONCE_INIT;
+
+static void disassembler_build_table(void);
+static const instruction_info_t *disassembler_scan(uint16_t opcode);
+static void disassembler_extract(instruction_t *instruction, uint16_t opcode,
+                                 const instruction_info_t *instruction_info);
+
 int disassembler_dump(const rombuffer_t *rom) {
     if (rom == NULL) {
         return -1;
@@ -341,14 +352,8 @@ int disassembler_disassemble(instruction_t *instruction, const uint16_t opcode)
         return -1;
     }
 
-    const instruction_info_t *instruction_info = disassembler_lookup(opcode);
-    instruction->instruction_info = instruction_info;
-
-    for (size_t i = 0; i < instruction_info->operand_count; i++) {
-        uint16_t mask = operand_masks[instruction_info->operand_types[i]][0];
-        uint16_t shift = operand_masks[instruction_info->operand_types[i]][1];
-        instruction->operands[i] = (opcode & mask) >> shift;
-    }
+    pthread_once(&decode_table_once, disassembler_build_table);
+    *instruction = decode_table[opcode];
 
     return 0;
 }
@@ -452,6 +457,104 @@ int disassembler_format(char *formatted_instruction, size_t size,
 }
 
 const instruction_info_t *disassembler_lookup(uint16_t opcode) {
+    pthread_once(&decode_table_once, disassembler_build_table);
+
+    return decode_table[opcode].instruction_info;
+}
+
+//checks every decode table entry without the code that built it: at most
+//one instruction besides .data may match an opcode, so table order never
+//decides, and operands are cut straight from the opcode nibbles
+int disassembler_validate(void) {
+    pthread_once(&decode_table_once, disassembler_build_table);
+
+    const instruction_info_t *data = NULL;
+    for (size_t i = 0; i < instruction_info_table_size; i++) {
+        const instruction_info_t *instruction_info = &instruction_info_table[i];
+        if (instruction_info->instruction_type == INSTRUCTION_DATA) {
+            data = instruction_info;
+        }
+
+        //an id bit outside the mask can never compare equal
+        if (instruction_info->id & ~instruction_info->mask) {
+            fprintf(stderr, "%s never matches an opcode\n",
+                    instruction_info->mnemonic);
+            return -4;
+        }
+    }
+
+    for (uint32_t opcode = 0; opcode < DECODE_TABLE_SIZE; opcode++) {
+        const instruction_info_t *expected = data;
+        for (size_t i = 0; i < instruction_info_table_size; i++) {
+            const instruction_info_t *instruction_info =
+                &instruction_info_table[i];
+            if (instruction_info == data ||
+                (opcode & instruction_info->mask) != instruction_info->id)
+            {
+                continue;
+            }
+
+            if (expected != data) {
+                fprintf(stderr, "opcode %04x matches both %s and %s\n",
+                        opcode, expected->mnemonic,
+                        instruction_info->mnemonic);
+                return -4;
+            }
+            expected = instruction_info;
+        }
+
+        const instruction_t *actual = &decode_table[opcode];
+        if (actual->instruction_info != expected) {
+            fprintf(stderr, "decode table mismatch at opcode %04x\n", opcode);
+            return -4;
+        }
+
+        for (size_t i = 0; i < 3; i++) {
+            uint16_t operand = 0;
+            if (i < expected->operand_count) {
+                switch (expected->operand_types[i]) {
+                    case OPERAND_VX:
+                        operand = (opcode >> 8) & 0x0F;
+                        break;
+                    case OPERAND_VY:
+                        operand = (opcode >> 4) & 0x0F;
+                        break;
+                    case OPERAND_N:
+                        operand = opcode & 0x0F;
+                        break;
+                    case OPERAND_KK:
+                        operand = opcode & 0xFF;
+                        break;
+                    case OPERAND_NNN:
+                        operand = opcode & 0x0FFF;
+                        break;
+                    case OPERAND_DATA:
+                        operand = opcode;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            if (actual->operands[i] != operand) {
+                fprintf(stderr, "operand %zu mismatch at opcode %04x\n", i,
+                        opcode);
+                return -4;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void disassembler_build_table(void) {
+    for (uint32_t opcode = 0; opcode < DECODE_TABLE_SIZE; opcode++) {
+        disassembler_extract(&decode_table[opcode], opcode,
+                             disassembler_scan(opcode));
+    }
+}
+
+static const instruction_info_t *disassembler_scan(uint16_t opcode) {
     for (size_t i = 0; i < instruction_info_table_size; i++) {
         const instruction_info_t *instruction_info = &instruction_info_table[i];
 
@@ -462,3 +565,15 @@ const instruction_info_t *disassembler_lookup(uint16_t opcode) {
     
     return NULL;
 }
+
+static void disassembler_extract(instruction_t *instruction, uint16_t opcode,
+                                 const instruction_info_t *instruction_info) {
+    memset(instruction->operands, 0, sizeof(instruction->operands));
+    instruction->instruction_info = instruction_info;
+
+    for (size_t i = 0; i < instruction_info->operand_count; i++) {
+        uint16_t mask = operand_masks[instruction_info->operand_types[i]][0];
+        uint16_t shift = operand_masks[instruction_info->operand_types[i]][1];
+        instruction->operands[i] = (opcode & mask) >> shift;
+    }
+}
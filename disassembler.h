@@ -77,9 +77,12 @@ typedef struct instruction {
 //      -1: pointer is NULL
 //      -2: insufficient memory
 //      -3: no matching operand_type
+//      -4: decode table disagrees with instruction_info_table, or an
+//          opcode matches more than one of its instructions
 int disassembler_dump(const rombuffer_t *opcodes);
 int disassembler_disassemble(instruction_t *instruction, const uint16_t opcode);
 int disassembler_format(char *formatted_instruction, size_t size,
                         const instruction_t *instruction);
 
 const instruction_info_t *disassembler_lookup(uint16_t opcode);
+int disassembler_validate(void);
@@ -0,0 +1,396 @@
+//gym.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rombuffer.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "gym.h"
+
+//polls of a sequence counter before a waiting side yields its core, then
+//before it starts to sleep
+#define GYM_SPIN_LIMIT 2000
+#define GYM_YIELD_LIMIT 100000
+#define GYM_IDLE_NS 50000
+
+typedef struct gym_env {
+    cpu_t *cpu;
+    gym_slot_t *slot;
+    uint32_t cycle_remainder;
+    uint64_t start_count;               //instruction count at the reset
+} gym_env_t;
+
+typedef struct gym {
+    gym_header_t *header;
+    size_t size;
+    char *shm_name;                     //NULL for a private mapping
+
+    rombuffer_t rom;
+    uint32_t ips;
+    gym_env_t *envs;
+} gym_t;
+
+static uint16_t gym_get_keyboard(void *context);
+static uint8_t gym_wait_keypress(void *context);
+static void gym_present_frame(void *context,
+                              const uint64_t display[DISPLAY_HEIGHT],
+                              uint32_t dirty_rows);
+static void gym_step_env(gym_t *gym, gym_env_t *env);
+static void gym_reset_env(gym_t *gym, gym_env_t *env);
+static void gym_write_peeks(const gym_t *gym, gym_env_t *env);
+static void gym_pause(uint32_t *spins);
+static size_t gym_buffer_size(uint32_t env_count);
+
+static const cpu_io_interface_t gym_io_interface = {
+    .get_keyboard = gym_get_keyboard,
+    .wait_keypress = gym_wait_keypress,
+    .present_frame = gym_present_frame
+};
+
+gym_t *gym_new(const rombuffer_t *rom, const gym_config_t *config,
+               const char *shm_name) {
+    if (rom == NULL || config == NULL || config->env_count == 0 ||
+        config->ips == 0 || config->peek_count > GYM_MAX_PEEKS)
+    {
+        return NULL;
+    }
+
+    gym_t *gym = calloc(1, sizeof(gym_t));
+    if (gym == NULL) {
+        return NULL;
+    }
+
+    gym->ips = config->ips;
+    gym->size = gym_buffer_size(config->env_count);
+    gym->rom.length = rom->length;
+    gym->rom.data = malloc(rom->length * sizeof(rom->data[0]) + 1);
+    gym->envs = calloc(config->env_count, sizeof(gym_env_t));
+    if (gym->rom.data == NULL || gym->envs == NULL) {
+        gym_free(gym);
+        return NULL;
+    }
+    memcpy(gym->rom.data, rom->data, rom->length * sizeof(rom->data[0]));
+
+    void *buffer;
+    if (shm_name != NULL) {
+        gym->shm_name = strdup(shm_name);
+        if (gym->shm_name == NULL) {
+            gym_free(gym);
+            return NULL;
+        }
+
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd == -1) {
+            free(gym->shm_name);
+            gym->shm_name = NULL;
+            gym_free(gym);
+            return NULL;
+        }
+
+        buffer = MAP_FAILED;
+        if (ftruncate(fd, gym->size) == 0) {
+            buffer = mmap(NULL, gym->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+        }
+        close(fd);
+    } else {
+        buffer = mmap(NULL, gym->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (buffer == MAP_FAILED) {
+        gym_free(gym);
+        return NULL;
+    }
+
+    //a fresh mapping reads as zeros, only the nonzero fields are set
+    gym->header = buffer;
+    gym->header->version = GYM_VERSION;
+    gym->header->env_count = config->env_count;
+    gym->header->peek_count = config->peek_count;
+    gym->header->slot_size = sizeof(gym_slot_t);
+    memcpy(gym->header->peek_addresses, config->peek_addresses,
+           config->peek_count * sizeof(config->peek_addresses[0]));
+    atomic_init(&gym->header->step_sequence, 0);
+    atomic_init(&gym->header->done_sequence, 0);
+    atomic_init(&gym->header->closed, 0);
+
+    for (uint32_t i = 0; i < config->env_count; i++) {
+        gym_env_t *env = &gym->envs[i];
+        env->slot = gym_get_slot(gym->header, i);
+        env->cpu = cpu_new(&gym_io_interface, env);
+        if (env->cpu == NULL || cpu_set_engine(env->cpu, config->engine) ||
+            cpu_set_fast_reset(env->cpu, true))
+        {
+            gym_free(gym);
+            return NULL;
+        }
+
+        env->slot->seed = config->seed + i;
+        gym_reset_env(gym, env);
+    }
+
+    //agents attaching earlier see no magic and retry
+    atomic_thread_fence(memory_order_release);
+    gym->header->magic = GYM_MAGIC;
+
+    return gym;
+}
+
+gym_header_t *gym_get_header(gym_t *gym) {
+    if (gym == NULL) {
+        return NULL;
+    }
+
+    return gym->header;
+}
+
+size_t gym_get_size(const gym_t *gym) {
+    if (gym == NULL) {
+        return 0;
+    }
+
+    return gym->size;
+}
+
+//steps every env one frame with the keys in its slot
+int gym_step(gym_t *gym) {
+    if (gym == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < gym->header->env_count; i++) {
+        gym_step_env(gym, &gym->envs[i]);
+    }
+
+    return 0;
+}
+
+//answers step requests until the agent sets closed
+int gym_serve(gym_t *gym) {
+    if (gym == NULL) {
+        return -1;
+    }
+
+    gym_header_t *header = gym->header;
+    uint64_t done = atomic_load_explicit(&header->done_sequence,
+                                         memory_order_relaxed);
+    uint32_t spins = 0;
+    while (!atomic_load_explicit(&header->closed, memory_order_acquire)) {
+        //acquire pairs with the agent's release, so its slot writes are
+        //visible before the step reads them
+        uint64_t sequence = atomic_load_explicit(&header->step_sequence,
+                                                 memory_order_acquire);
+        if (sequence == done) {
+            gym_pause(&spins);
+            continue;
+        }
+
+        gym_step(gym);
+
+        done = sequence;
+        atomic_store_explicit(&header->done_sequence, done,
+                              memory_order_release);
+        spins = 0;
+    }
+
+    return 0;
+}
+
+void gym_free(gym_t *gym) {
+    if (gym == NULL) {
+        return;
+    }
+
+    if (gym->envs != NULL) {
+        for (uint32_t i = 0; gym->header != NULL &&
+                             i < gym->header->env_count; i++)
+        {
+            cpu_free(gym->envs[i].cpu);
+        }
+    }
+
+    if (gym->header != NULL) {
+        munmap(gym->header, gym->size);
+    }
+    if (gym->shm_name != NULL) {
+        shm_unlink(gym->shm_name);
+    }
+
+    free(gym->shm_name);
+    free(gym->envs);
+    free(gym->rom.data);
+    free(gym);
+}
+
+//maps the buffer of a gym serving under shm_name
+gym_header_t *gym_attach(const char *shm_name) {
+    if (shm_name == NULL) {
+        return NULL;
+    }
+
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(gym_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    gym_header_t *header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (header->magic != GYM_MAGIC || header->version != GYM_VERSION ||
+        header->slot_size != sizeof(gym_slot_t) ||
+        (size_t)st.st_size < gym_buffer_size(header->env_count))
+    {
+        munmap(header, st.st_size);
+        return NULL;
+    }
+
+    return header;
+}
+
+gym_slot_t *gym_get_slot(gym_header_t *header, uint32_t env) {
+    if (header == NULL || env >= header->env_count) {
+        return NULL;
+    }
+
+    return (gym_slot_t *)(header + 1) + env;
+}
+
+//publishes the keys written to the slots, returns the sequence to wait for
+uint64_t gym_request_step(gym_header_t *header) {
+    uint64_t sequence = atomic_load_explicit(&header->step_sequence,
+                                             memory_order_relaxed) + 1;
+    atomic_store_explicit(&header->step_sequence, sequence,
+                          memory_order_release);
+
+    return sequence;
+}
+
+void gym_wait_step(gym_header_t *header, uint64_t sequence) {
+    uint32_t spins = 0;
+    while (atomic_load_explicit(&header->done_sequence,
+                                memory_order_acquire) < sequence)
+    {
+        gym_pause(&spins);
+    }
+}
+
+void gym_detach(gym_header_t *header) {
+    if (header == NULL) {
+        return;
+    }
+
+    munmap(header, gym_buffer_size(header->env_count));
+}
+
+static uint16_t gym_get_keyboard(void *context) {
+    return ((gym_env_t *)context)->slot->keys;
+}
+
+//only reached with keys held, see gym_step_env
+static uint8_t gym_wait_keypress(void *context) {
+    return scheduler_lowest_key(((gym_env_t *)context)->slot->keys);
+}
+
+static void gym_present_frame(void *context,
+                              const uint64_t display[DISPLAY_HEIGHT],
+                              uint32_t dirty_rows) {
+    gym_slot_t *slot = ((gym_env_t *)context)->slot;
+
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (dirty_rows & (1u << y)) {
+            slot->observation[y] = display[y];
+        }
+    }
+}
+
+//one frame of an env, see scheduler_step_frame
+static void gym_step_env(gym_t *gym, gym_env_t *env) {
+    gym_slot_t *slot = env->slot;
+
+    if (slot->reset) {
+        gym_reset_env(gym, env);
+    }
+    if (slot->error_code) {
+        return;
+    }
+
+    slot->error_code = scheduler_step_frame(env->cpu, gym->ips,
+                                            &env->cycle_remainder,
+                                            slot->keys);
+    slot->frame++;
+    slot->instructions = cpu_get_instruction_count(env->cpu) -
+                         env->start_count;
+    gym_write_peeks(gym, env);
+}
+
+//restarts the env from the seed in its slot. after the first load only the
+//memory the episode wrote is restored
+static void gym_reset_env(gym_t *gym, gym_env_t *env) {
+    gym_slot_t *slot = env->slot;
+
+    cpu_set_seed(env->cpu, slot->seed);
+    int error_code = 0;
+    if (cpu_reset_fast(env->cpu)) {
+        error_code = cpu_reset(env->cpu, &gym->rom);
+    }
+    cpu_present(env->cpu);
+
+    env->cycle_remainder = 0;
+    env->start_count = cpu_get_instruction_count(env->cpu);
+
+    //a failed reset stays in the slot, so the env is not stepped
+    slot->reset = 0;
+    slot->error_code = error_code;
+    slot->frame = 0;
+    slot->instructions = 0;
+    gym_write_peeks(gym, env);
+}
+
+static void gym_write_peeks(const gym_t *gym, gym_env_t *env) {
+    const gym_header_t *header = gym->header;
+
+    for (uint32_t i = 0; i < header->peek_count; i++) {
+        env->slot->peek[i] = cpu_peek(env->cpu, header->peek_addresses[i]);
+    }
+}
+
+//busy waits for a moment, then yields so the other side can run when
+//they share a core, then backs off to short sleeps so an idle side does
+//not hold one
+static void gym_pause(uint32_t *spins) {
+    if (*spins < GYM_SPIN_LIMIT) {
+        (*spins)++;
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    } else if (*spins < GYM_YIELD_LIMIT) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        struct timespec idle = { .tv_sec = 0, .tv_nsec = GYM_IDLE_NS };
+        nanosleep(&idle, NULL);
+    }
+}
+
+static size_t gym_buffer_size(uint32_t env_count) {
+    return sizeof(gym_header_t) + (size_t)env_count * sizeof(gym_slot_t);
+}
@@ -0,0 +1,78 @@
+//gym.h
+
+#pragma once
+
+#define GYM_MAGIC 0x4D594743            //"CGYM"
+#define GYM_VERSION 1
+#define GYM_MAX_PEEKS 64
+
+typedef struct gym gym_t;
+
+typedef struct gym_config {
+    uint32_t env_count;
+    uint32_t ips;                       //emulated instructions per second
+    cpu_engine_t engine;
+    uint64_t seed;                      //env i starts from seed + i
+    uint32_t peek_count;
+    uint16_t peek_addresses[GYM_MAX_PEEKS];
+} gym_config_t;
+
+//start of the shared buffer, followed by env_count slots. the agent writes
+//keys, then bumps step_sequence; the gym steps every env one frame and
+//sets done_sequence to the same value once all slots are written
+typedef struct gym_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t env_count;
+    uint32_t peek_count;
+    uint32_t slot_size;
+    uint32_t reserved;
+    uint16_t peek_addresses[GYM_MAX_PEEKS];
+
+    _Alignas(64) _Atomic uint64_t step_sequence;       //agent
+    _Alignas(64) _Atomic uint64_t done_sequence;       //gym
+    _Alignas(64) _Atomic uint32_t closed;              //agent, stops serving
+} gym_header_t;
+
+typedef struct gym_slot {
+    //written by the agent
+    uint16_t keys;                      //held for the whole step
+    uint8_t reset;                      //restart the env from seed first
+    uint8_t reserved;
+    uint32_t reserved2;
+    uint64_t seed;
+
+    //written by the gym
+    _Alignas(64) int32_t error_code;    //the env stops until it is reset
+    uint32_t reserved3;
+    uint64_t frame;                     //frames since the last reset
+    uint64_t instructions;
+    uint64_t observation[DISPLAY_HEIGHT];
+    uint8_t peek[GYM_MAX_PEEKS];        //bytes at peek_addresses
+} gym_slot_t;
+
+//owner side, runs the envs. shm_name names a POSIX shared memory object
+//created for the buffer, NULL maps it privately for use in process
+gym_t *gym_new(const rombuffer_t *rom, const gym_config_t *config,
+               const char *shm_name);
+gym_header_t *gym_get_header(gym_t *gym);
+size_t gym_get_size(const gym_t *gym);
+int gym_step(gym_t *gym);
+int gym_serve(gym_t *gym);
+void gym_free(gym_t *gym);
+
+//agent side
+gym_header_t *gym_attach(const char *shm_name);
+gym_slot_t *gym_get_slot(gym_header_t *header, uint32_t env);
+uint64_t gym_request_step(gym_header_t *header);
+void gym_wait_step(gym_header_t *header, uint64_t sequence);
+void gym_detach(gym_header_t *header);
+
+//observations are laid out as for present_frame. a step runs each env like
+//a turbo scheduler frame, except that a key wait with no key held stalls
+//until a later step instead of blocking. gym_step steps once with the keys
+//in the slots, gym_serve steps whenever step_sequence moves past
+//done_sequence and returns 0 once closed is set. both sides spin on the
+//counters and only sleep after a while without a request, so a step costs
+//no syscalls and no copies beyond the slots themselves. gym_free unlinks
+//the shared memory object
@@ -0,0 +1,194 @@
+//headless.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+#include "cpu_soa.h"
+#include "scheduler.h"
+#include "null_io.h"
+#include "headless.h"
+
+static uint32_t headless_burst(uint32_t ips, uint32_t *remainder);
+static double headless_now();
+
+int headless_run(cpu_t *cpu, null_io_t *null_io,
+                 const headless_config_t *config, headless_result_t *result) {
+    if (cpu == NULL || null_io == NULL || config == NULL || result == NULL ||
+        (config->max_frames == 0 && config->max_instructions == 0))
+    {
+        return -1;
+    }
+
+    result->frames = 0;
+    result->instructions = 0;
+    result->display_hash = 0;
+    result->seconds = 0;
+    result->error_code = 0;
+
+    scheduler_t *scheduler = scheduler_new(cpu, config->ips, true);
+    if (scheduler == NULL) {
+        result->error_code = -1;
+        return -1;
+    }
+
+    uint64_t start_count = cpu_get_instruction_count(cpu);
+    double start = headless_now();
+
+    while ((config->max_frames == 0 ||
+            result->frames < config->max_frames) &&
+           (config->max_instructions == 0 ||
+            result->instructions < config->max_instructions))
+    {
+        null_io_set_frame(null_io, result->frames);
+
+        result->error_code = scheduler_run_frame(scheduler);
+        result->instructions = cpu_get_instruction_count(cpu) - start_count;
+        if (result->error_code) {
+            break;
+        }
+
+        result->frames++;
+    }
+
+    result->seconds = headless_now() - start;
+
+    //an error ends the frame before it is presented
+    cpu_present(cpu);
+    result->display_hash = null_io_get_display_hash(null_io);
+    scheduler_free(scheduler);
+
+    return result->error_code;
+}
+
+//runs every lane for the same frames and instruction budgets as
+//headless_check_lane, so the two can be compared
+int headless_run_lanes(cpu_soa_t *cpu_soa, uint32_t lane_count,
+                       null_io_t *null_io, const headless_config_t *config,
+                       headless_result_t *result) {
+    if (cpu_soa == NULL || lane_count == 0 || null_io == NULL ||
+        config == NULL || result == NULL ||
+        (config->max_frames == 0 && config->max_instructions == 0))
+    {
+        return -1;
+    }
+
+    result->frames = 0;
+    result->instructions = 0;
+    result->display_hash = 0;
+    result->seconds = 0;
+    result->error_code = 0;
+
+    uint32_t remainder = 0;
+    bool running = true;
+    double start = headless_now();
+
+    while (running &&
+           (config->max_frames == 0 ||
+            result->frames < config->max_frames) &&
+           (config->max_instructions == 0 ||
+            result->instructions < config->max_instructions))
+    {
+        null_io_set_frame(null_io, result->frames);
+        uint16_t keys = null_io_interface.get_keyboard(null_io);
+        for (uint32_t lane = 0; lane < lane_count; lane++) {
+            cpu_soa_set_keys(cpu_soa, lane, keys);
+        }
+
+        cpu_soa_run(cpu_soa, headless_burst(config->ips, &remainder));
+        cpu_soa_decrement_timers(cpu_soa);
+        result->frames++;
+
+        //the run ends once every lane has stopped on an error
+        running = false;
+        result->instructions = 0;
+        for (uint32_t lane = 0; lane < lane_count; lane++) {
+            result->instructions +=
+                cpu_soa_get_instruction_count(cpu_soa, lane);
+            running |= cpu_soa_get_error(cpu_soa, lane) == 0;
+        }
+    }
+
+    result->seconds = headless_now() - start;
+
+    uint64_t display[DISPLAY_HEIGHT];
+    cpu_soa_get_display(cpu_soa, 0, display);
+    null_io_interface.present_frame(null_io, display, UINT32_MAX);
+    result->display_hash = null_io_get_display_hash(null_io);
+    result->error_code = cpu_soa_get_error(cpu_soa, 0);
+
+    return result->error_code;
+}
+
+//runs cpu one instruction at a time for frames frames, with the budgets
+//of headless_run_lanes and a key wait stalling while no key is held
+int headless_check_lane(const cpu_soa_t *cpu_soa, uint32_t lane, cpu_t *cpu,
+                        null_io_t *null_io, const headless_config_t *config,
+                        uint64_t frames, headless_result_t *result) {
+    if (cpu_soa == NULL || cpu == NULL || null_io == NULL || config == NULL ||
+        result == NULL)
+    {
+        return -1;
+    }
+
+    result->frames = 0;
+    result->error_code = 0;
+
+    uint32_t remainder = 0;
+    uint64_t start_count = cpu_get_instruction_count(cpu);
+    double start = headless_now();
+
+    while (result->frames < frames && !result->error_code) {
+        null_io_set_frame(null_io, result->frames);
+        uint16_t keys = null_io_interface.get_keyboard(null_io);
+
+        uint32_t burst = headless_burst(config->ips, &remainder);
+        for (uint32_t cycle = 0; cycle < burst; cycle++) {
+            if (keys == 0 && cpu_key_wait_pending(cpu)) {
+                break;
+            }
+
+            result->error_code = cpu_execute(cpu);
+            if (result->error_code) {
+                break;
+            }
+        }
+
+        cpu_decrement_timers(cpu);
+        result->frames++;
+    }
+
+    result->seconds = headless_now() - start;
+    result->instructions = cpu_get_instruction_count(cpu) - start_count;
+
+    cpu_present(cpu);
+    result->display_hash = null_io_get_display_hash(null_io);
+
+    uint64_t lane_display[DISPLAY_HEIGHT];
+    uint64_t display[DISPLAY_HEIGHT];
+    cpu_soa_get_display(cpu_soa, lane, lane_display);
+    null_io_get_display(null_io, display);
+
+    return result->error_code != cpu_soa_get_error(cpu_soa, lane) ||
+           result->instructions !=
+           cpu_soa_get_instruction_count(cpu_soa, lane) ||
+           memcmp(display, lane_display, sizeof(display)) != 0;
+}
+
+//instructions in the next frame, carrying the remainder of ips
+static uint32_t headless_burst(uint32_t ips, uint32_t *remainder) {
+    *remainder += ips;
+    uint32_t burst = *remainder / SCHEDULER_TIMER_HZ;
+    *remainder %= SCHEDULER_TIMER_HZ;
+
+    return burst;
+}
+
+static double headless_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,44 @@
+//headless.h
+
+#pragma once
+
+typedef struct headless_config {
+    uint32_t ips;                       //emulated instructions per second
+    uint64_t max_frames;                //0 for no limit
+    uint64_t max_instructions;          //0 for no limit
+} headless_config_t;
+
+typedef struct headless_result {
+    uint64_t frames;
+    uint64_t instructions;
+    uint64_t display_hash;              //see null_io_get_display_hash
+    double seconds;                     //wall time
+    int error_code;
+} headless_result_t;
+
+//runs a cpu attached to null_io_interface with null_io as its context in
+//turbo until either limit is reached, feeding the script one frame at a
+//time
+int headless_run(cpu_t *cpu, null_io_t *null_io,
+                 const headless_config_t *config, headless_result_t *result);
+//runs the first lane_count lanes of a loaded cpu_soa, every lane holding
+//the keys of the null_io script
+int headless_run_lanes(cpu_soa_t *cpu_soa, uint32_t lane_count,
+                       null_io_t *null_io, const headless_config_t *config,
+                       headless_result_t *result);
+//replays one lane on a cpu loaded and seeded like it, returns 1 when the
+//cpu ends up in a different place
+int headless_check_lane(const cpu_soa_t *cpu_soa, uint32_t lane, cpu_t *cpu,
+                        null_io_t *null_io, const headless_config_t *config,
+                        uint64_t frames, headless_result_t *result);
+
+//limits are checked at frame boundaries, so max_instructions may be
+//overshot by up to one frame. at least one limit must be set, otherwise
+//headless_run returns -1 like it does for NULL arguments
+//
+//headless_run_lanes issues ips / 60 instructions per frame to every lane
+//without the scheduler's idle loop cut, so instructions counts every
+//lane's instructions and is comparable across lane counts. display_hash
+//and error_code are those of lane 0, and the run also ends once every
+//lane has failed. headless_check_lane fills result for the cpu alone and
+//compares error code, instruction count and display against the lane
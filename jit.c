@@ -0,0 +1,454 @@
+//jit.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "rombuffer.h"
+#include "disassembler.h"
+#include "jit.h"
+
+#define JIT_BUFFER_SIZE (256 * 1024)
+#define JIT_MAX_CODE_SIZE 2048      //upper bound for one compiled run
+#define JIT_PINNED_MAX 7            //chip-8 registers held in host registers
+
+#if defined(__x86_64__)
+
+enum host_register {
+    HOST_RAX = 0,
+    HOST_RCX = 1,
+    HOST_RDX = 2,
+    HOST_RSI = 6,
+    HOST_RDI = 7,
+    HOST_R8  = 8,
+    HOST_R9  = 9,
+    HOST_R10 = 10,
+    HOST_R11 = 11
+};
+
+//caller-saved registers, so generated code needs no spills of its own.
+//rdi holds the cpu_t pointer and rax is scratch
+static const uint8_t pinnable_registers[JIT_PINNED_MAX] = {
+    HOST_RCX, HOST_RDX, HOST_RSI, HOST_R8, HOST_R9, HOST_R10, HOST_R11
+};
+
+//8 bit register to register opcodes, op r/m8, r8
+enum alu_opcode {
+    ALU_ADD = 0x00,
+    ALU_OR  = 0x08,
+    ALU_AND = 0x20,
+    ALU_SUB = 0x28,
+    ALU_XOR = 0x30,
+    ALU_MOV = 0x88
+};
+
+enum setcc_opcode {
+    SETC = 0x92,
+    SETA = 0x97
+};
+
+typedef struct jit {
+    jit_layout_t layout;
+
+    uint8_t *buffer;
+    size_t used;
+    size_t page_size;
+} jit_t;
+
+typedef struct jit_emitter {
+    uint8_t *code;
+    size_t length;
+} jit_emitter_t;
+
+static bool jit_registers_used(const instruction_t *instruction,
+                               uint16_t *registers);
+static int jit_protect(jit_t *jit, size_t offset, size_t length, int prot);
+static void emit_byte(jit_emitter_t *emitter, uint8_t byte);
+static void emit_u16(jit_emitter_t *emitter, uint16_t value);
+static void emit_u32(jit_emitter_t *emitter, uint32_t value);
+static void emit_rex(jit_emitter_t *emitter, uint8_t reg, uint8_t rm);
+static void emit_rdi_disp32(jit_emitter_t *emitter, uint8_t reg,
+                            size_t offset);
+static void emit_load_mem8(jit_emitter_t *emitter, uint8_t host, size_t offset);
+static void emit_store_mem8(jit_emitter_t *emitter, size_t offset, uint8_t host);
+static void emit_store_mem16(jit_emitter_t *emitter, size_t offset,
+                             uint16_t value);
+static void emit_alu(jit_emitter_t *emitter, enum alu_opcode opcode,
+                     uint8_t dst, uint8_t src);
+static void emit_mov_imm8(jit_emitter_t *emitter, uint8_t dst, uint8_t value);
+static void emit_group1_imm8(jit_emitter_t *emitter, uint8_t extension,
+                             uint8_t dst, uint8_t value);
+static void emit_shift1(jit_emitter_t *emitter, uint8_t extension, uint8_t dst);
+static void emit_setcc(jit_emitter_t *emitter, enum setcc_opcode opcode,
+                       uint8_t dst);
+
+jit_t *jit_new(const jit_layout_t *layout) {
+    if (layout == NULL) {
+        return NULL;
+    }
+
+    jit_t *jit = malloc(sizeof(jit_t));
+    if (jit == NULL) {
+        return NULL;
+    }
+
+    //never writable and executable at once: jit_compile opens the pages it
+    //emits into for writing and closes them again before returning
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->layout = *layout;
+    jit->used = 0;
+    jit->page_size = sysconf(_SC_PAGESIZE);
+
+    return jit;
+}
+
+size_t jit_compilable(const instruction_t *instructions, size_t count) {
+    uint16_t registers = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint16_t instruction_registers = registers;
+        if (!jit_registers_used(&instructions[i], &instruction_registers) ||
+            __builtin_popcount(instruction_registers) > JIT_PINNED_MAX)
+        {
+            return i;
+        }
+
+        registers = instruction_registers;
+    }
+
+    return count;
+}
+
+jit_code_t jit_compile(jit_t *jit, const instruction_t *instructions,
+                       size_t count, uint16_t start_pc) {
+    if (jit == NULL || instructions == NULL) {
+        return NULL;
+    }
+
+    if (jit_compilable(instructions, count) != count ||
+        jit->used + JIT_MAX_CODE_SIZE > JIT_BUFFER_SIZE)
+    {
+        return NULL;
+    }
+
+    //assign host registers to every chip-8 register the run touches
+    uint16_t registers = 0;
+    for (size_t i = 0; i < count; i++) {
+        jit_registers_used(&instructions[i], &registers);
+    }
+
+    uint8_t host[16];
+    size_t pinned = 0;
+    for (uint8_t v = 0; v < 16; v++) {
+        if (registers & (1 << v)) {
+            host[v] = pinnable_registers[pinned++];
+        }
+    }
+
+    if (jit_protect(jit, jit->used, JIT_MAX_CODE_SIZE,
+                    PROT_READ | PROT_WRITE))
+    {
+        return NULL;
+    }
+
+    const jit_layout_t *layout = &jit->layout;
+    jit_emitter_t emitter = {jit->buffer + jit->used, 0};
+
+    //prologue: load pinned registers
+    for (uint8_t v = 0; v < 16; v++) {
+        if (registers & (1 << v)) {
+            emit_load_mem8(&emitter, host[v], layout->registers + v);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const uint16_t *operands = instructions[i].operands;
+        uint8_t x = operands[0] & 0x0F;
+        uint8_t y = operands[1] & 0x0F;
+
+        switch (instructions[i].instruction_info->instruction_type) {
+            case INSTRUCTION_LD_VX_KK:
+                emit_mov_imm8(&emitter, host[x], operands[1]);
+                break;
+            case INSTRUCTION_ADD_VX_KK:
+                emit_group1_imm8(&emitter, 0, host[x], operands[1]);
+                break;
+            case INSTRUCTION_LD_VX_VY:
+                emit_alu(&emitter, ALU_MOV, host[x], host[y]);
+                break;
+            case INSTRUCTION_OR_VX_VY:
+                emit_alu(&emitter, ALU_OR, host[x], host[y]);
+                break;
+            case INSTRUCTION_AND_VX_VY:
+                emit_alu(&emitter, ALU_AND, host[x], host[y]);
+                break;
+            case INSTRUCTION_XOR_VX_VY:
+                emit_alu(&emitter, ALU_XOR, host[x], host[y]);
+                break;
+            case INSTRUCTION_ADD_VX_VY:
+                //VF = carry
+                emit_alu(&emitter, ALU_ADD, host[x], host[y]);
+                emit_setcc(&emitter, SETC, host[0x0F]);
+                break;
+            case INSTRUCTION_SUB_VX_VY:
+                //VF = Vx > Vy, which is "above" after Vx - Vy
+                emit_alu(&emitter, ALU_SUB, host[x], host[y]);
+                emit_setcc(&emitter, SETA, host[0x0F]);
+                break;
+            case INSTRUCTION_SUBN_VX_VY:
+                emit_alu(&emitter, ALU_MOV, HOST_RAX, host[y]);
+                emit_alu(&emitter, ALU_SUB, HOST_RAX, host[x]);
+                emit_setcc(&emitter, SETA, host[0x0F]);
+                emit_alu(&emitter, ALU_MOV, host[x], HOST_RAX);
+                break;
+            case INSTRUCTION_SHR_VX_VY:
+                //VF = bit shifted out
+                emit_shift1(&emitter, 5, host[x]);
+                emit_setcc(&emitter, SETC, host[0x0F]);
+                break;
+            case INSTRUCTION_SHL_VX_VY:
+                //VF = Vx & 0x80, as the interpreter does
+                emit_alu(&emitter, ALU_MOV, host[0x0F], host[x]);
+                emit_group1_imm8(&emitter, 4, host[0x0F], 0x80);
+                emit_shift1(&emitter, 4, host[x]);
+                break;
+            case INSTRUCTION_LD_I_NNN:
+                emit_store_mem16(&emitter, layout->I, operands[1]);
+                break;
+            case INSTRUCTION_LD_VX_DT:
+                emit_load_mem8(&emitter, host[x], layout->DT);
+                break;
+            case INSTRUCTION_LD_DT_VX:
+                emit_store_mem8(&emitter, layout->DT, host[y]);
+                break;
+            case INSTRUCTION_LD_ST_VX:
+                emit_store_mem8(&emitter, layout->ST, host[y]);
+                break;
+            default:
+                jit_protect(jit, jit->used, JIT_MAX_CODE_SIZE,
+                            PROT_READ | PROT_EXEC);
+                return NULL;
+        }
+    }
+
+    //epilogue: write back pinned registers and advance pc
+    for (uint8_t v = 0; v < 16; v++) {
+        if (registers & (1 << v)) {
+            emit_store_mem8(&emitter, layout->registers + v, host[v]);
+        }
+    }
+
+    emit_store_mem16(&emitter, layout->pc, start_pc + count * 2);
+    emit_byte(&emitter, 0xC3);          //ret
+
+    if (jit_protect(jit, jit->used, JIT_MAX_CODE_SIZE,
+                    PROT_READ | PROT_EXEC))
+    {
+        return NULL;
+    }
+
+    jit_code_t code = (jit_code_t)(void *)emitter.code;
+    jit->used += emitter.length;
+
+    return code;
+}
+
+void jit_flush(jit_t *jit) {
+    if (jit == NULL) {
+        return;
+    }
+
+    jit->used = 0;
+}
+
+void jit_free(jit_t *jit) {
+    if (jit == NULL) {
+        return;
+    }
+
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+//changes the protection of the pages covering buffer[offset, offset + length)
+static int jit_protect(jit_t *jit, size_t offset, size_t length, int prot) {
+    size_t first = offset & ~(jit->page_size - 1);
+    size_t last = offset + length;
+    if (last > JIT_BUFFER_SIZE) {
+        last = JIT_BUFFER_SIZE;
+    }
+
+    return mprotect(jit->buffer + first, last - first, prot);
+}
+
+//adds the chip-8 registers instruction reads or writes to registers,
+//returns false if the instruction cannot be compiled
+static bool jit_registers_used(const instruction_t *instruction,
+                               uint16_t *registers) {
+    const uint16_t *operands = instruction->operands;
+
+    switch (instruction->instruction_info->instruction_type) {
+        case INSTRUCTION_LD_VX_KK:
+        case INSTRUCTION_ADD_VX_KK:
+        case INSTRUCTION_LD_VX_DT:
+            *registers |= 1 << operands[0];
+            return true;
+        case INSTRUCTION_LD_VX_VY:
+        case INSTRUCTION_OR_VX_VY:
+        case INSTRUCTION_AND_VX_VY:
+        case INSTRUCTION_XOR_VX_VY:
+            *registers |= (1 << operands[0]) | (1 << operands[1]);
+            return true;
+        case INSTRUCTION_ADD_VX_VY:
+        case INSTRUCTION_SUB_VX_VY:
+        case INSTRUCTION_SUBN_VX_VY:
+            //VF as an operand depends on the interpreter's write order
+            if (operands[0] == 0x0F || operands[1] == 0x0F) {
+                return false;
+            }
+            *registers |= (1 << operands[0]) | (1 << operands[1]) |
+                          (1 << 0x0F);
+            return true;
+        case INSTRUCTION_SHR_VX_VY:
+        case INSTRUCTION_SHL_VX_VY:
+            if (operands[0] == 0x0F) {
+                return false;
+            }
+            *registers |= (1 << operands[0]) | (1 << 0x0F);
+            return true;
+        case INSTRUCTION_LD_DT_VX:
+        case INSTRUCTION_LD_ST_VX:
+            *registers |= 1 << operands[1];
+            return true;
+        case INSTRUCTION_LD_I_NNN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void emit_byte(jit_emitter_t *emitter, uint8_t byte) {
+    emitter->code[emitter->length++] = byte;
+}
+
+static void emit_u16(jit_emitter_t *emitter, uint16_t value) {
+    emit_byte(emitter, value & 0xFF);
+    emit_byte(emitter, value >> 8);
+}
+
+static void emit_u32(jit_emitter_t *emitter, uint32_t value) {
+    emit_u16(emitter, value & 0xFFFF);
+    emit_u16(emitter, value >> 16);
+}
+
+//REX prefix, always emitted so byte registers 4-7 are sil/dil, not ah/bh
+static void emit_rex(jit_emitter_t *emitter, uint8_t reg, uint8_t rm) {
+    emit_byte(emitter, 0x40 | ((reg & 0x08) >> 1) | ((rm & 0x08) >> 3));
+}
+
+//ModRM addressing [rdi + disp32]
+static void emit_rdi_disp32(jit_emitter_t *emitter, uint8_t reg,
+                            size_t offset) {
+    emit_byte(emitter, 0x80 | ((reg & 0x07) << 3) | HOST_RDI);
+    emit_u32(emitter, offset);
+}
+
+//movzx host32, byte [rdi + offset]
+static void emit_load_mem8(jit_emitter_t *emitter, uint8_t host,
+                           size_t offset) {
+    emit_rex(emitter, host, HOST_RDI);
+    emit_byte(emitter, 0x0F);
+    emit_byte(emitter, 0xB6);
+    emit_rdi_disp32(emitter, host, offset);
+}
+
+//mov byte [rdi + offset], host8
+static void emit_store_mem8(jit_emitter_t *emitter, size_t offset,
+                            uint8_t host) {
+    emit_rex(emitter, host, HOST_RDI);
+    emit_byte(emitter, 0x88);
+    emit_rdi_disp32(emitter, host, offset);
+}
+
+//mov word [rdi + offset], value
+static void emit_store_mem16(jit_emitter_t *emitter, size_t offset,
+                             uint16_t value) {
+    emit_byte(emitter, 0x66);
+    emit_byte(emitter, 0xC7);
+    emit_rdi_disp32(emitter, 0, offset);
+    emit_u16(emitter, value);
+}
+
+//op dst8, src8
+static void emit_alu(jit_emitter_t *emitter, enum alu_opcode opcode,
+                     uint8_t dst, uint8_t src) {
+    emit_rex(emitter, src, dst);
+    emit_byte(emitter, opcode);
+    emit_byte(emitter, 0xC0 | ((src & 0x07) << 3) | (dst & 0x07));
+}
+
+//mov dst8, value
+static void emit_mov_imm8(jit_emitter_t *emitter, uint8_t dst, uint8_t value) {
+    emit_rex(emitter, 0, dst);
+    emit_byte(emitter, 0xB0 | (dst & 0x07));
+    emit_byte(emitter, value);
+}
+
+//add (/0) or and (/4) dst8, value
+static void emit_group1_imm8(jit_emitter_t *emitter, uint8_t extension,
+                             uint8_t dst, uint8_t value) {
+    emit_rex(emitter, 0, dst);
+    emit_byte(emitter, 0x80);
+    emit_byte(emitter, 0xC0 | (extension << 3) | (dst & 0x07));
+    emit_byte(emitter, value);
+}
+
+//shl (/4) or shr (/5) dst8, 1
+static void emit_shift1(jit_emitter_t *emitter, uint8_t extension,
+                        uint8_t dst) {
+    emit_rex(emitter, 0, dst);
+    emit_byte(emitter, 0xD0);
+    emit_byte(emitter, 0xC0 | (extension << 3) | (dst & 0x07));
+}
+
+//setcc dst8
+static void emit_setcc(jit_emitter_t *emitter, enum setcc_opcode opcode,
+                       uint8_t dst) {
+    emit_rex(emitter, 0, dst);
+    emit_byte(emitter, 0x0F);
+    emit_byte(emitter, opcode);
+    emit_byte(emitter, 0xC0 | (dst & 0x07));
+}
+
+#else
+
+jit_t *jit_new(const jit_layout_t *layout) {
+    return NULL;
+}
+
+size_t jit_compilable(const instruction_t *instructions, size_t count) {
+    return 0;
+}
+
+jit_code_t jit_compile(jit_t *jit, const instruction_t *instructions,
+                       size_t count, uint16_t start_pc) {
+    return NULL;
+}
+
+void jit_flush(jit_t *jit) {
+    return;
+}
+
+void jit_free(jit_t *jit) {
+    return;
+}
+
+#endif
@@ -0,0 +1,35 @@
+//jit.h
+
+#pragma once
+
+typedef struct jit jit_t;
+
+//native code for a run of instructions, called with the owning cpu_t.
+//it updates the registers, I, DT, ST and pc, but not the instruction count
+typedef void (*jit_code_t)(void *cpu);
+
+//byte offsets of the cpu_t fields generated code reads and writes
+typedef struct jit_layout {
+    size_t registers;
+    size_t I;
+    size_t DT;
+    size_t ST;
+    size_t pc;
+} jit_layout_t;
+
+//jit_new returns NULL when the host is not x86-64 or executable memory
+//cannot be mapped
+jit_t *jit_new(const jit_layout_t *layout);
+size_t jit_compilable(const instruction_t *instructions, size_t count);
+jit_code_t jit_compile(jit_t *jit, const instruction_t *instructions,
+                       size_t count, uint16_t start_pc);
+void jit_flush(jit_t *jit);
+void jit_free(jit_t *jit);
+
+//jit_compilable returns how many leading instructions jit_compile can
+//translate: register and timer arithmetic only, anything touching memory,
+//the display, input or control flow is left to the interpreter.
+//jit_compile returns NULL once the code buffer is full, jit_flush empties
+//it and invalidates every function it returned. the buffer is only ever
+//writable or executable, never both, so jit_compile must not be called
+//from generated code
@@ -9,30 +9,104 @@
 #include "rombuffer.h"
 #include "disassembler.h"
 #include "cpu.h"
+#include "scheduler.h"
+#include "rewind_buffer.h"
+#include "replay_io.h"
+#include "triplebuffer.h"
 #include "sdl_io.h"
 
 #define ROM_DIRECTORY "../c8games/"
+#define DEFAULT_IPS 700
+#define MAX_RUN_AHEAD 8
+#define REWIND_BUFFER_SIZE (8 << 20)
+#define REWIND_MAX_FRAMES (5 * 60 * SCHEDULER_TIMER_HZ)
+#define REWIND_KEYFRAME_INTERVAL SCHEDULER_TIMER_HZ
+#define USAGE "Usage: %s [-d] [-v] [-t | -j] [-V] [-i ips] [-T] [-s seed] " \
+              "[-a frames | -r record | -p play] rom\n"
+
+//everything the cpu thread works on
+typedef struct session {
+    cpu_t *cpu;
+    scheduler_t *scheduler;
+    sdl_io_t *sdl_io;
+    uint8_t *save_state;                //one slot, cpu_state_size bytes
+    bool saved;
+    rewind_buffer_t *rewind_buffer;     //NULL while recording or replaying
+} session_t;
 
 static bool quit_signal = false;
 static pthread_mutex_t mutex_quit = PTHREAD_MUTEX_INITIALIZER;
 
-static void *cpu_thread_function(void *cpu);
-static void *ui_thread_function(void *dummy_arg);
+static void *cpu_thread_function(void *session);
+static void *ui_thread_function(void *sdl_io);
+static int service_hotkey(session_t *session);
+static int run_frame(session_t *session);
 
 int main(int argc, char *argv[]) {
     int opt;
     bool disassembly = false;
-    while ((opt = getopt(argc, argv, "d")) != -1) {
+    bool validate = false;
+    bool vsync = false;
+    bool turbo = false;
+    uint64_t seed = 0;
+    unsigned long ips = DEFAULT_IPS;
+    unsigned long run_ahead = 0;
+    cpu_engine_t engine = CPU_ENGINE_INTERPRETER;
+    const char *record_path = NULL;
+    const char *play_path = NULL;
+    while ((opt = getopt(argc, argv, "dvtjVi:Ts:a:r:p:")) != -1) {
         if (opt == 'd') {
             disassembly = true;
+        } else if (opt == 'v') {
+            validate = true;
+        } else if (opt == 't') {
+            engine = CPU_ENGINE_THREADED;
+        } else if (opt == 'j') {
+            engine = CPU_ENGINE_JIT;
+        } else if (opt == 'V') {
+            vsync = true;
+        } else if (opt == 'i') {
+            ips = strtoul(optarg, NULL, 10);
+            if (ips > UINT32_MAX) {
+                ips = 0;
+            }
+        } else if (opt == 'T') {
+            turbo = true;
+        } else if (opt == 's') {
+            seed = strtoull(optarg, NULL, 0);
+        } else if (opt == 'a') {
+            run_ahead = strtoul(optarg, NULL, 10);
+            if (run_ahead > MAX_RUN_AHEAD) {
+                run_ahead = MAX_RUN_AHEAD;
+            }
+        } else if (opt == 'r') {
+            record_path = optarg;
+        } else if (opt == 'p') {
+            play_path = optarg;
         } else {
-            fprintf(stderr, "Usage: %s [-l] rom\n", argv[0]);
+            fprintf(stderr, USAGE, argv[0]);
             exit(EXIT_FAILURE);
         }
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "Usage: %s [-l] rom\n", argv[0]);
+    // if -v option enabled, check the opcode decode table
+    // and terminate emulator
+    if (validate) {
+        if (disassembler_validate()) {
+            fprintf(stderr, "Error: decode table validation failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        printf("decode table ok\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    //speculative frames would read keys a recording or replay has to see
+    //exactly once
+    if (optind >= argc || (record_path != NULL) + (play_path != NULL) +
+                          (run_ahead > 0) > 1)
+    {
+        fprintf(stderr, USAGE, argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -64,27 +138,92 @@ int main(int argc, char *argv[]) {
     }
 
     // begin default emulator behavior
-    cpu_t *cpu = cpu_new(&sdl_io_interface);
+    sdl_io_t *sdl_io = sdl_io_new(rom_name, vsync);
+    if (sdl_io == NULL) {
+        fprintf(stderr, "Error: unable to initialize display\n");
+        exit(EXIT_FAILURE);
+    }
+
+    //a recording or replay wraps the display, and the replay brings the
+    //seed and speed of the recorded run
+    replay_io_t *replay_io = NULL;
+    if (record_path != NULL) {
+        replay_io = replay_io_new_recorder(record_path, &sdl_io_interface,
+                                           sdl_io, rom_opcodes, seed, ips);
+    } else if (play_path != NULL) {
+        replay_io = replay_io_new_player(play_path, &sdl_io_interface,
+                                         sdl_io, rom_opcodes);
+        if (replay_io != NULL) {
+            seed = replay_io_get_seed(replay_io);
+            ips = replay_io_get_ips(replay_io);
+        }
+    }
+    if ((record_path != NULL || play_path != NULL) && replay_io == NULL) {
+        fprintf(stderr, "Error: unable to open input log %s\n",
+                record_path != NULL ? record_path : play_path);
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_t *cpu = replay_io != NULL ?
+                 cpu_new(&replay_io_interface, replay_io) :
+                 cpu_new(&sdl_io_interface, sdl_io);
     if (cpu == NULL) {
         fprintf(stderr, "Error: unable to initialize CPU\n");
         exit(EXIT_FAILURE);
     }
 
-    cpu_load(cpu, rom_opcodes);
+    if (cpu_set_engine(cpu, engine)) {
+        fprintf(stderr, "Error: unable to select CPU engine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_set_seed(cpu, seed);
+    if (cpu_load(cpu, rom_opcodes)) {
+        fprintf(stderr, "Error: unable to load ROM\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replay_io != NULL) {
+        replay_io_set_cpu(replay_io, cpu);
+    }
+
+    scheduler_t *scheduler = scheduler_new(cpu, ips, turbo);
+    if (scheduler == NULL) {
+        fprintf(stderr, "Error: instructions per second must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    scheduler_set_lockstep(scheduler, replay_io != NULL);
+    scheduler_set_run_ahead(scheduler, run_ahead);
+
+    session_t session = {
+        .cpu = cpu,
+        .scheduler = scheduler,
+        .sdl_io = sdl_io,
+        .save_state = malloc(cpu_state_size()),
+        .saved = false,
+        .rewind_buffer = replay_io != NULL ? NULL :
+                         rewind_buffer_new(REWIND_BUFFER_SIZE,
+                                           REWIND_MAX_FRAMES,
+                                           REWIND_KEYFRAME_INTERVAL)
+    };
+    if (session.save_state == NULL ||
+        (replay_io == NULL && session.rewind_buffer == NULL))
+    {
+        fprintf(stderr, "Error: unable to allocate save states\n");
+        exit(EXIT_FAILURE);
+    }
 
     pthread_t cpu_thread, ui_thread;
     int cpu_thread_ret, ui_thread_ret;
 
-    sdl_io_init(rom_name);
-
-    ui_thread_ret = pthread_create(&ui_thread, NULL, ui_thread_function, NULL);
+    ui_thread_ret = pthread_create(&ui_thread, NULL, ui_thread_function,
+                                   (void *)sdl_io);
     if (ui_thread_ret) {
         fprintf(stderr, "error: pthread_create() returns: %d\n",
                 ui_thread_ret);
     }
 
     cpu_thread_ret = pthread_create(&cpu_thread, NULL,
-                                    cpu_thread_function, (void *)cpu); 
+                                    cpu_thread_function, (void *)&session);
     if (cpu_thread_ret) {
         fprintf(stderr, "error: pthread_create() returns: %d\n",
                 cpu_thread_ret);
@@ -98,8 +237,19 @@ int main(int argc, char *argv[]) {
     int *cpu_error_ptr;
     pthread_join(cpu_thread, (void *)&cpu_error_ptr);
 
-    sdl_io_terminate();
+    triplebuffer_stats_t frame_stats;
+    sdl_io_get_stats(sdl_io, &frame_stats);
+    fprintf(stderr, "frames: %llu presented, %llu rendered, %llu dropped\n",
+            (unsigned long long)frame_stats.published,
+            (unsigned long long)frame_stats.acquired,
+            (unsigned long long)frame_stats.dropped);
+
+    free(session.save_state);
+    rewind_buffer_free(session.rewind_buffer);
+    scheduler_free(scheduler);
+    replay_io_free(replay_io);
     cpu_free(cpu);
+    sdl_io_free(sdl_io);
     rombuffer_free(rom_opcodes);
 
     if (*cpu_error_ptr) {
@@ -110,8 +260,7 @@ int main(int argc, char *argv[]) {
     exit(EXIT_SUCCESS);
 }
 
-static void *cpu_thread_function(void *cpu) {
-    int us_counter = 0;
+static void *cpu_thread_function(void *session) {
     static int cpu_error = 0;
 
     while (!cpu_error) {
@@ -122,22 +271,70 @@ static void *cpu_thread_function(void *cpu) {
         }
         pthread_mutex_unlock(&mutex_quit);
 
-        usleep(3000);
-
-        us_counter += 1;
-        if (us_counter >= 6) {
-            us_counter = 0;
-            cpu_decrement_timers(cpu);
+        cpu_error = run_frame((session_t *) session);
+        if (!cpu_error) {
+            cpu_error = service_hotkey((session_t *) session);
         }
-
-        cpu_error = cpu_execute((cpu_t *) cpu);
     }
 
     return &cpu_error;
 }
 
-static void *ui_thread_function(void *dummy_arg) {
-    sdl_ui_run();
+static void *ui_thread_function(void *sdl_io) {
+    sdl_io_t *sdl_ios[] = {sdl_io};
+    sdl_io_run(sdl_ios, 1);
 
     return NULL;
 }
+
+//runs one frame and records it, or steps one frame back while rewinding
+static int run_frame(session_t *session) {
+    if (session->rewind_buffer == NULL) {
+        return scheduler_run_frame(session->scheduler);
+    }
+
+    if (!sdl_io_rewind_held(session->sdl_io)) {
+        int error_code = scheduler_run_frame(session->scheduler);
+        if (error_code) {
+            return error_code;
+        }
+
+        return rewind_buffer_push(session->rewind_buffer, session->cpu);
+    }
+
+    int error_code = rewind_buffer_step_back(session->rewind_buffer,
+                                             session->cpu);
+    if (error_code < 0) {
+        return error_code;
+    }
+
+    error_code = cpu_present(session->cpu);
+    if (error_code) {
+        return error_code;
+    }
+
+    return scheduler_skip_frame(session->scheduler);
+}
+
+//save and load state requests from the ui, handled between frames. like
+//rewinding, loading would break a recording or replay, so it is ignored
+static int service_hotkey(session_t *session) {
+    sdl_io_hotkey_t hotkey = sdl_io_take_hotkey(session->sdl_io);
+
+    if (hotkey == SDL_IO_HOTKEY_SAVE_STATE) {
+        session->saved = !cpu_save_state(session->cpu, session->save_state,
+                                         cpu_state_size());
+    } else if (hotkey == SDL_IO_HOTKEY_LOAD_STATE && session->saved &&
+               session->rewind_buffer != NULL)
+    {
+        int error_code = cpu_load_state(session->cpu, session->save_state,
+                                        cpu_state_size());
+        if (error_code) {
+            return error_code;
+        }
+
+        return cpu_present(session->cpu);
+    }
+
+    return 0;
+}
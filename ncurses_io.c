@@ -5,15 +5,27 @@
 #include <string.h>
 #include <curses.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include "cpu.h"
 #include "ncurses_io.h"
 
 #define CLEAR_CHAR ' '
 
-static WINDOW *win;
-static int keyboard_input;
+typedef struct ncurses_io {
+    WINDOW *win;
+
+    atomic_uint_least16_t keyboard_mask;    //published by the ui thread
+    pthread_mutex_t mutex_keys;
+    pthread_cond_t key_pressed;
+    int pending_key;                    //hex key pressed, -1 for none
+    bool quit_requested;
+} ncurses_io_t;
+
+//curses drives one terminal and is not reentrant, so these are shared by
+//every instance
 static pthread_mutex_t mutex_ncurses = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int terminal_users;
 
 enum key_map {
     KEY_MAP_QUIT = 'q',
@@ -35,200 +47,188 @@ enum key_map {
     KEY_MAP_F = '.'
 };
 
-static uint16_t ncurses_io_get_keyboard();
-static uint8_t ncurses_io_wait_keypress();
-static bool ncurses_io_get_pixel(uint8_t x, uint8_t y);    
-static void ncurses_io_draw_pixel(uint8_t x, uint8_t y, bool fill);
+static uint16_t ncurses_io_get_keyboard(void *context);
+static uint8_t ncurses_io_wait_keypress(void *context);
+static int ncurses_io_hex_key(int keyboard_input);
+static void ncurses_io_present_frame(void *context,
+                                    const uint64_t display[DISPLAY_HEIGHT],
+                                    uint32_t dirty_rows);
 
 const cpu_io_interface_t ncurses_io_interface = {
     .get_keyboard = ncurses_io_get_keyboard,
     .wait_keypress = ncurses_io_wait_keypress,
-    .get_pixel = ncurses_io_get_pixel,
-    .draw_pixel = ncurses_io_draw_pixel
+    .present_frame = ncurses_io_present_frame
 };
 
-void ncurses_io_init() {
-    initscr();
-    noecho();
+//the first instance takes over the terminal, the last one gives it back
+ncurses_io_t *ncurses_io_new(int y, int x) {
+    ncurses_io_t *ncurses_io = calloc(1, sizeof(ncurses_io_t));
+    if (ncurses_io == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&ncurses_io->keyboard_mask, 0);
+    pthread_mutex_init(&ncurses_io->mutex_keys, NULL);
+    pthread_cond_init(&ncurses_io->key_pressed, NULL);
+    ncurses_io->pending_key = -1;
 
-    win = newwin(DISPLAY_HEIGHT, DISPLAY_WIDTH, 0, 0);
-    nodelay(win, true);
+    pthread_mutex_lock(&mutex_ncurses);
+    if (terminal_users++ == 0) {
+        initscr();
+        noecho();
+    }
+
+    ncurses_io->win = newwin(DISPLAY_HEIGHT, DISPLAY_WIDTH, y, x);
+    if (ncurses_io->win != NULL) {
+        nodelay(ncurses_io->win, true);
+    }
+    pthread_mutex_unlock(&mutex_ncurses);
+
+    if (ncurses_io->win == NULL) {
+        ncurses_io_free(ncurses_io);
+        return NULL;
+    }
+
+    return ncurses_io;
 }
 
-void ncurses_io_terminate() {
-    delwin(win);
-    delwin(stdscr);
-    endwin();
+void ncurses_io_free(ncurses_io_t *ncurses_io) {
+    if (ncurses_io == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex_ncurses);
+    if (ncurses_io->win != NULL) {
+        delwin(ncurses_io->win);
+    }
+
+    if (--terminal_users == 0) {
+        endwin();
+    }
+    pthread_mutex_unlock(&mutex_ncurses);
+
+    pthread_cond_destroy(&ncurses_io->key_pressed);
+    pthread_mutex_destroy(&ncurses_io->mutex_keys);
+    free(ncurses_io);
 }
 
-void ncurses_ui_run() {
+//reads the keys typed into this instance's window until quit is pressed
+void ncurses_io_run(ncurses_io_t *ncurses_io) {
+    int keyboard_input = ERR;
+
     while (keyboard_input != KEY_MAP_QUIT) {
         usleep(50000);
         pthread_mutex_lock(&mutex_ncurses);
-        keyboard_input = wgetch(win);
+        keyboard_input = wgetch(ncurses_io->win);
         pthread_mutex_unlock(&mutex_ncurses);
+
+        //terminals only report presses, so a key reads as held until the
+        //next poll
+        int hex_key = ncurses_io_hex_key(keyboard_input);
+        atomic_store(&ncurses_io->keyboard_mask,
+                     hex_key >= 0 ? 1 << hex_key : 0);
+
+        if (hex_key >= 0 || keyboard_input == KEY_MAP_QUIT) {
+            pthread_mutex_lock(&ncurses_io->mutex_keys);
+            if (keyboard_input == KEY_MAP_QUIT) {
+                ncurses_io->quit_requested = true;
+                pthread_cond_broadcast(&ncurses_io->key_pressed);
+            } else {
+                ncurses_io->pending_key = hex_key;
+                pthread_cond_signal(&ncurses_io->key_pressed);
+            }
+            pthread_mutex_unlock(&ncurses_io->mutex_keys);
+        }
     }
 }
 
-static uint16_t ncurses_io_get_keyboard() {
-    uint16_t hex_keys;
+static uint16_t ncurses_io_get_keyboard(void *context) {
+    ncurses_io_t *ncurses_io = context;
 
-    pthread_mutex_lock(&mutex_ncurses);
+    return atomic_load(&ncurses_io->keyboard_mask);
+}
+
+//sleeps until the ui thread reports a key press, returns 0 after quit
+static uint8_t ncurses_io_wait_keypress(void *context) {
+    ncurses_io_t *ncurses_io = context;
+    uint8_t return_value;
+
+    pthread_mutex_lock(&ncurses_io->mutex_keys);
+    while (ncurses_io->pending_key < 0 && !ncurses_io->quit_requested) {
+        pthread_cond_wait(&ncurses_io->key_pressed, &ncurses_io->mutex_keys);
+    }
+
+    if (ncurses_io->quit_requested) {
+        return_value = 0x00;
+    } else {
+        return_value = ncurses_io->pending_key;
+    }
+    ncurses_io->pending_key = -1;
+    pthread_mutex_unlock(&ncurses_io->mutex_keys);
+
+    return return_value;
+}
+
+//returns the hex key mapped to keyboard_input, or -1
+static int ncurses_io_hex_key(int keyboard_input) {
     switch (keyboard_input) {
-        case ERR:
-            hex_keys = 0x00;
-            break;
         case KEY_MAP_1:
-            hex_keys = 1 << 0x01;
-            break;
+            return 0x01;
         case KEY_MAP_2:
-            hex_keys = 1 << 0x02;
-            break;
+            return 0x02;
         case KEY_MAP_3:
-            hex_keys = 1 << 0x03;
-            break;
+            return 0x03;
         case KEY_MAP_C:
-            hex_keys = 1 << 0x0C;
-            break;
+            return 0x0C;
         case KEY_MAP_4:
-            hex_keys = 1 << 0x04;
-            break;
+            return 0x04;
         case KEY_MAP_5:
-            hex_keys = 1 << 0x05;
-            break;
+            return 0x05;
         case KEY_MAP_6:
-            hex_keys = 1 << 0x06;
-            break;
+            return 0x06;
         case KEY_MAP_D:
-            hex_keys = 1 << 0x0D;
-            break;
+            return 0x0D;
         case KEY_MAP_7:
-            hex_keys = 1 << 0x07;
-            break;
+            return 0x07;
         case KEY_MAP_8:
-            hex_keys = 1 << 0x08;
-            break;
+            return 0x08;
         case KEY_MAP_9:
-            hex_keys = 1 << 0x09;
-            break;
+            return 0x09;
         case KEY_MAP_E:
-            hex_keys = 1 << 0x0E;
-            break;
+            return 0x0E;
         case KEY_MAP_A:
-            hex_keys = 1 << 0x0A;
-            break;
+            return 0x0A;
         case KEY_MAP_0:
-            hex_keys = 1;
-            break;
+            return 0x00;
         case KEY_MAP_B:
-            hex_keys = 1 << 0x0B;
-            break;
+            return 0x0B;
         case KEY_MAP_F:
-            hex_keys = 1 << 0x0F;
-            break;
+            return 0x0F;
         default:
-            hex_keys = 0x00;
+            return -1;
     }
-    pthread_mutex_unlock(&mutex_ncurses);
-
-    return hex_keys;
 }
 
-static uint8_t ncurses_io_wait_keypress() {
-    uint8_t return_value;
-    bool unacceptable = true;
-
-    while (unacceptable) {
-        unacceptable = false;
-
-        pthread_mutex_lock(&mutex_ncurses);
-        switch (keyboard_input) {
-            case KEY_MAP_QUIT:
-                return_value = 0x00;
-                break;
-            case ERR:
-                unacceptable = true;
-                break;
-            case KEY_MAP_1:
-                return_value = 0x01;
-                break;
-            case KEY_MAP_2:
-                return_value = 0x02;
-                break;
-            case KEY_MAP_3:
-                return_value = 0x03;
-                break;
-            case KEY_MAP_C:
-                return_value = 0x0C;
-                break;
-            case KEY_MAP_4:
-                return_value = 0x04;
-                break;
-            case KEY_MAP_5:
-                return_value = 0x05;
-                break;
-            case KEY_MAP_6:
-                return_value = 0x06;
-                break;
-            case KEY_MAP_D:
-                return_value = 0x0D;
-                break;
-            case KEY_MAP_7:
-                return_value = 0x07;
-                break;
-            case KEY_MAP_8:
-                return_value = 0x08;
-                break;
-            case KEY_MAP_9:
-                return_value = 0x09;
-                break;
-            case KEY_MAP_E:
-                return_value = 0x0E;
-                break;
-            case KEY_MAP_A:
-                return_value = 0x0A;
-                break;
-            case KEY_MAP_0:
-                return_value = 0x00;
-                break;
-            case KEY_MAP_B:
-                return_value = 0x0B;
-                break;
-            case KEY_MAP_F:
-                return_value = 0x0F;
-                break;
-            default:
-                unacceptable = true;
-        }
-        keyboard_input = ERR;
-        pthread_mutex_unlock(&mutex_ncurses);
-    }
-
-    return return_value;
-}
+static void ncurses_io_present_frame(void *context,
+                                    const uint64_t display[DISPLAY_HEIGHT],
+                                    uint32_t dirty_rows) {
+    ncurses_io_t *ncurses_io = context;
+    WINDOW *win = ncurses_io->win;
 
-static bool ncurses_io_get_pixel(uint8_t x, uint8_t y) {
-    bool return_value;
     pthread_mutex_lock(&mutex_ncurses);
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (!(dirty_rows & (1U << y))) {
+            continue;
+        }
 
-    if (mvwinch(win, y, x) == CLEAR_CHAR) {
-        return_value = false;
-    } else {
-        return_value = true;
-    }
-
-    pthread_mutex_unlock(&mutex_ncurses);
-
-    return return_value;
-}
-
-static void ncurses_io_draw_pixel(uint8_t x, uint8_t y, bool fill) {
-    pthread_mutex_lock(&mutex_ncurses);
-    wmove(win, y, x);
-    if (fill) {
-        wadd_wch(win, WACS_CKBOARD);
-    } else {
-        waddch(win, CLEAR_CHAR);
+        wmove(win, y, 0);
+        for (uint8_t x = 0; x < DISPLAY_WIDTH; x++) {
+            if (display[y] & (1ULL << (63 - x))) {
+                wadd_wch(win, WACS_CKBOARD);
+            } else {
+                waddch(win, CLEAR_CHAR);
+            }
+        }
     }
     wrefresh(win);
     pthread_mutex_unlock(&mutex_ncurses);
@@ -2,8 +2,12 @@
 
 #pragma once
 
+typedef struct ncurses_io ncurses_io_t;
+
+//pass an ncurses_io_t as the io context of cpu_new
 extern const cpu_io_interface_t ncurses_io_interface;
 
-void ncurses_io_init();
-void ncurses_io_terminate();
-void ncurses_ui_run();
+//y and x place the instance's 64x32 window on the terminal
+ncurses_io_t *ncurses_io_new(int y, int x);
+void ncurses_io_free(ncurses_io_t *ncurses_io);
+void ncurses_io_run(ncurses_io_t *ncurses_io);
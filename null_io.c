@@ -0,0 +1,114 @@
+//null_io.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "scheduler.h"
+#include "null_io.h"
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+typedef struct null_io {
+    uint64_t framebuffer[DISPLAY_HEIGHT];
+    const null_io_event_t *script;
+    size_t script_length;
+    size_t script_position;             //next event to apply
+    uint16_t keyboard_mask;
+} null_io_t;
+
+static uint16_t null_io_get_keyboard(void *context);
+static uint8_t null_io_wait_keypress(void *context);
+static void null_io_present_frame(void *context,
+                                  const uint64_t display[DISPLAY_HEIGHT],
+                                  uint32_t dirty_rows);
+
+const cpu_io_interface_t null_io_interface = {
+    .get_keyboard = null_io_get_keyboard,
+    .wait_keypress = null_io_wait_keypress,
+    .present_frame = null_io_present_frame
+};
+
+null_io_t *null_io_new() {
+    null_io_t *null_io = calloc(1, sizeof(null_io_t));
+    if (null_io == NULL) {
+        return NULL;
+    }
+
+    return null_io;
+}
+
+void null_io_set_script(null_io_t *null_io, const null_io_event_t *events,
+                        size_t length) {
+    null_io->script = events;
+    null_io->script_length = events != NULL ? length : 0;
+    null_io->script_position = 0;
+    null_io->keyboard_mask = 0;
+}
+
+//applies every scripted event up to and including frame
+void null_io_set_frame(null_io_t *null_io, uint64_t frame) {
+    while (null_io->script_position < null_io->script_length &&
+           null_io->script[null_io->script_position].frame <= frame)
+    {
+        null_io->keyboard_mask =
+            null_io->script[null_io->script_position].keys;
+        null_io->script_position++;
+    }
+}
+
+void null_io_get_display(const null_io_t *null_io,
+                         uint64_t display[DISPLAY_HEIGHT]) {
+    memcpy(display, null_io->framebuffer, sizeof(null_io->framebuffer));
+}
+
+uint64_t null_io_get_display_hash(const null_io_t *null_io) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (null_io->framebuffer[y] >> shift) & 0xFF;
+            hash *= FNV_PRIME;
+        }
+    }
+
+    return hash;
+}
+
+void null_io_free(null_io_t *null_io) {
+    free(null_io);
+}
+
+static uint16_t null_io_get_keyboard(void *context) {
+    null_io_t *null_io = context;
+
+    return null_io->keyboard_mask;
+}
+
+static uint8_t null_io_wait_keypress(void *context) {
+    null_io_t *null_io = context;
+
+    while (null_io->keyboard_mask == 0 &&
+           null_io->script_position < null_io->script_length)
+    {
+        null_io->keyboard_mask =
+            null_io->script[null_io->script_position].keys;
+        null_io->script_position++;
+    }
+
+    return scheduler_lowest_key(null_io->keyboard_mask);
+}
+
+static void null_io_present_frame(void *context,
+                                  const uint64_t display[DISPLAY_HEIGHT],
+                                  uint32_t dirty_rows) {
+    null_io_t *null_io = context;
+
+    for (uint8_t y = 0; y < DISPLAY_HEIGHT; y++) {
+        if (dirty_rows & (1U << y)) {
+            null_io->framebuffer[y] = display[y];
+        }
+    }
+}
@@ -0,0 +1,29 @@
+//null_io.h
+
+#pragma once
+
+typedef struct null_io null_io_t;
+
+//pass a null_io_t as the io context of cpu_new
+extern const cpu_io_interface_t null_io_interface;
+
+//key mask held from the start of frame until the next event
+typedef struct null_io_event {
+    uint64_t frame;
+    uint16_t keys;
+} null_io_event_t;
+
+null_io_t *null_io_new();
+//events must be sorted by frame and stay valid until the next call
+void null_io_set_script(null_io_t *null_io, const null_io_event_t *events,
+                        size_t length);
+void null_io_set_frame(null_io_t *null_io, uint64_t frame);
+void null_io_get_display(const null_io_t *null_io,
+                         uint64_t display[DISPLAY_HEIGHT]);
+uint64_t null_io_get_display_hash(const null_io_t *null_io);
+void null_io_free(null_io_t *null_io);
+
+//wait_keypress never blocks: it returns the lowest held key, otherwise it
+//skips ahead to the next scripted press, and returns 0 once the script is
+//exhausted. null_io_get_display_hash is FNV-1a over the rows, most
+//significant byte first
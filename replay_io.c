@@ -0,0 +1,392 @@
+//replay_io.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "replay_io.h"
+
+#define REPLAY_MAGIC 0x52493843         //"C8IR"
+#define REPLAY_VERSION 1
+#define REPLAY_HEADER_SIZE 32
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+typedef enum replay_event_kind {
+    REPLAY_EVENT_KEYS,                  //key mask changed
+    REPLAY_EVENT_PRESS,                 //wait_keypress returned a key
+    REPLAY_EVENT_END                    //recording stopped
+} replay_event_kind_t;
+
+typedef struct replay_event {
+    uint64_t instruction_count;
+    replay_event_kind_t kind;
+    uint16_t value;
+} replay_event_t;
+
+typedef struct replay_io {
+    const cpu_io_interface_t *inner;
+    void *inner_context;
+    const cpu_t *cpu;
+
+    uint64_t seed;
+    uint64_t rom_hash;
+    uint32_t ips;
+
+    FILE *file;                         //recording, NULL while playing
+    uint64_t last_count;                //instruction count of the last event
+    uint16_t keyboard_mask;
+
+    uint8_t *log;                       //whole log file, while playing
+    size_t log_length;
+    size_t log_position;                //after next
+    replay_event_t next;                //next event to feed back
+    uint64_t end_count;
+} replay_io_t;
+
+static uint16_t replay_io_get_keyboard(void *context);
+static uint8_t replay_io_wait_keypress(void *context);
+static void replay_io_present_frame(void *context,
+                                    const uint64_t display[DISPLAY_HEIGHT],
+                                    uint32_t dirty_rows);
+static void replay_io_write_event(replay_io_t *replay_io,
+                                  replay_event_kind_t kind, uint16_t value);
+static bool replay_io_read_event(replay_io_t *replay_io);
+static void replay_io_catch_up(replay_io_t *replay_io,
+                               uint64_t instruction_count);
+static uint64_t replay_io_rom_hash(const rombuffer_t *rom);
+static void replay_io_put(uint8_t *bytes, uint64_t value, uint8_t size);
+static uint64_t replay_io_get(const uint8_t *bytes, uint8_t size);
+
+const cpu_io_interface_t replay_io_interface = {
+    .get_keyboard = replay_io_get_keyboard,
+    .wait_keypress = replay_io_wait_keypress,
+    .present_frame = replay_io_present_frame
+};
+
+replay_io_t *replay_io_new_recorder(const char *path,
+                                    const cpu_io_interface_t *inner,
+                                    void *inner_context,
+                                    const rombuffer_t *rom, uint64_t seed,
+                                    uint32_t ips) {
+    if (path == NULL || inner == NULL || rom == NULL) {
+        return NULL;
+    }
+
+    replay_io_t *replay_io = calloc(1, sizeof(replay_io_t));
+    if (replay_io == NULL) {
+        return NULL;
+    }
+
+    replay_io->inner = inner;
+    replay_io->inner_context = inner_context;
+    replay_io->seed = seed;
+    replay_io->rom_hash = replay_io_rom_hash(rom);
+    replay_io->ips = ips;
+
+    uint8_t header[REPLAY_HEADER_SIZE] = {0};
+    replay_io_put(&header[0], REPLAY_MAGIC, 4);
+    replay_io_put(&header[4], REPLAY_VERSION, 4);
+    replay_io_put(&header[8], seed, 8);
+    replay_io_put(&header[16], replay_io->rom_hash, 8);
+    replay_io_put(&header[24], ips, 4);
+
+    replay_io->file = fopen(path, "wb");
+    if (replay_io->file == NULL) {
+        free(replay_io);
+        return NULL;
+    }
+
+    if (fwrite(header, REPLAY_HEADER_SIZE, 1, replay_io->file) != 1) {
+        fclose(replay_io->file);
+        free(replay_io);
+        return NULL;
+    }
+
+    return replay_io;
+}
+
+replay_io_t *replay_io_new_player(const char *path,
+                                  const cpu_io_interface_t *inner,
+                                  void *inner_context,
+                                  const rombuffer_t *rom) {
+    if (path == NULL || rom == NULL) {
+        return NULL;
+    }
+
+    FILE *log_f = fopen(path, "rb");
+    if (log_f == NULL) {
+        return NULL;
+    }
+
+    fseek(log_f, 0, SEEK_END);
+    long int log_length = ftell(log_f);
+    fseek(log_f, 0, SEEK_SET);
+
+    replay_io_t *replay_io = calloc(1, sizeof(replay_io_t));
+    if (replay_io == NULL || log_length < REPLAY_HEADER_SIZE) {
+        free(replay_io);
+        fclose(log_f);
+        return NULL;
+    }
+
+    replay_io->log = malloc(log_length);
+    if (replay_io->log == NULL ||
+        fread(replay_io->log, log_length, 1, log_f) != 1)
+    {
+        replay_io_free(replay_io);
+        fclose(log_f);
+        return NULL;
+    }
+    fclose(log_f);
+
+    replay_io->inner = inner;
+    replay_io->inner_context = inner_context;
+    replay_io->log_length = log_length;
+    replay_io->seed = replay_io_get(&replay_io->log[8], 8);
+    replay_io->rom_hash = replay_io_get(&replay_io->log[16], 8);
+    replay_io->ips = replay_io_get(&replay_io->log[24], 4);
+
+    if (replay_io_get(&replay_io->log[0], 4) != REPLAY_MAGIC ||
+        replay_io_get(&replay_io->log[4], 4) != REPLAY_VERSION ||
+        replay_io->rom_hash != replay_io_rom_hash(rom))
+    {
+        replay_io_free(replay_io);
+        return NULL;
+    }
+
+    //walk the log once to reject truncated events and find its end
+    replay_io->log_position = REPLAY_HEADER_SIZE;
+    while (replay_io_read_event(replay_io) &&
+           replay_io->next.kind != REPLAY_EVENT_END);
+    if (replay_io->log_position < replay_io->log_length) {
+        replay_io_free(replay_io);
+        return NULL;
+    }
+    replay_io->end_count = replay_io->next.instruction_count;
+
+    replay_io->log_position = REPLAY_HEADER_SIZE;
+    replay_io->next.instruction_count = 0;
+    replay_io_read_event(replay_io);
+
+    return replay_io;
+}
+
+int replay_io_set_cpu(replay_io_t *replay_io, const cpu_t *cpu) {
+    if (replay_io == NULL || cpu == NULL) {
+        return -1;
+    }
+
+    replay_io->cpu = cpu;
+    replay_io->last_count = cpu_get_instruction_count(cpu);
+
+    return 0;
+}
+
+uint64_t replay_io_get_seed(const replay_io_t *replay_io) {
+    return replay_io->seed;
+}
+
+uint32_t replay_io_get_ips(const replay_io_t *replay_io) {
+    return replay_io->ips;
+}
+
+uint64_t replay_io_get_instruction_count(const replay_io_t *replay_io) {
+    if (replay_io->file != NULL) {
+        return replay_io->last_count;
+    }
+
+    return replay_io->end_count;
+}
+
+//true once a player has fed back every event
+bool replay_io_finished(const replay_io_t *replay_io) {
+    return replay_io->file == NULL &&
+           replay_io->next.kind == REPLAY_EVENT_END;
+}
+
+void replay_io_free(replay_io_t *replay_io) {
+    if (replay_io == NULL) {
+        return;
+    }
+
+    if (replay_io->file != NULL) {
+        if (replay_io->cpu != NULL) {
+            replay_io_write_event(replay_io, REPLAY_EVENT_END, 0);
+        }
+        fclose(replay_io->file);
+    }
+
+    free(replay_io->log);
+    free(replay_io);
+}
+
+static uint16_t replay_io_get_keyboard(void *context) {
+    replay_io_t *replay_io = context;
+
+    if (replay_io->file == NULL) {
+        replay_io_catch_up(replay_io,
+                           cpu_get_instruction_count(replay_io->cpu));
+        return replay_io->keyboard_mask;
+    }
+
+    uint16_t keys = replay_io->inner->get_keyboard(replay_io->inner_context);
+    if (keys != replay_io->keyboard_mask) {
+        replay_io->keyboard_mask = keys;
+        replay_io_write_event(replay_io, REPLAY_EVENT_KEYS, keys);
+    }
+
+    return keys;
+}
+
+//a player never blocks: a press missing from the log reads as key 0
+static uint8_t replay_io_wait_keypress(void *context) {
+    replay_io_t *replay_io = context;
+
+    if (replay_io->file == NULL) {
+        uint64_t instruction_count = cpu_get_instruction_count(replay_io->cpu);
+        replay_io_catch_up(replay_io, instruction_count);
+
+        if (replay_io->next.kind != REPLAY_EVENT_PRESS ||
+            replay_io->next.instruction_count != instruction_count)
+        {
+            return 0;
+        }
+
+        uint8_t key = replay_io->next.value;
+        replay_io_read_event(replay_io);
+
+        return key;
+    }
+
+    uint8_t key = replay_io->inner->wait_keypress(replay_io->inner_context);
+    replay_io_write_event(replay_io, REPLAY_EVENT_PRESS, key);
+
+    return key;
+}
+
+static void replay_io_present_frame(void *context,
+                                    const uint64_t display[DISPLAY_HEIGHT],
+                                    uint32_t dirty_rows) {
+    replay_io_t *replay_io = context;
+
+    if (replay_io->inner != NULL) {
+        replay_io->inner->present_frame(replay_io->inner_context, display,
+                                        dirty_rows);
+    }
+}
+
+static void replay_io_write_event(replay_io_t *replay_io,
+                                  replay_event_kind_t kind, uint16_t value) {
+    uint64_t instruction_count = cpu_get_instruction_count(replay_io->cpu);
+    uint64_t varint = (instruction_count - replay_io->last_count) << 2 | kind;
+    replay_io->last_count = instruction_count;
+
+    uint8_t event[12];
+    uint8_t length = 0;
+    do {
+        event[length] = varint & 0x7F;
+        varint >>= 7;
+        if (varint) {
+            event[length] |= 0x80;
+        }
+        length++;
+    } while (varint);
+
+    if (kind == REPLAY_EVENT_KEYS) {
+        replay_io_put(&event[length], value, 2);
+        length += 2;
+    } else if (kind == REPLAY_EVENT_PRESS) {
+        event[length++] = value;
+    }
+
+    fwrite(event, length, 1, replay_io->file);
+}
+
+//decodes the event at log_position into next. the end of the log reads as
+//a closing event, false if nothing was left
+static bool replay_io_read_event(replay_io_t *replay_io) {
+    const uint8_t *log = replay_io->log;
+    size_t position = replay_io->log_position;
+
+    uint64_t varint = 0;
+    uint8_t shift = 0;
+    do {
+        if (position == replay_io->log_length || shift > 63) {
+            replay_io->next.kind = REPLAY_EVENT_END;
+            return false;
+        }
+        varint |= (uint64_t)(log[position] & 0x7F) << shift;
+        shift += 7;
+    } while (log[position++] & 0x80);
+
+    replay_event_t event = {
+        .instruction_count = replay_io->next.instruction_count + (varint >> 2),
+        .kind = varint & 0x03,
+        .value = 0
+    };
+
+    if (event.kind == REPLAY_EVENT_KEYS) {
+        if (replay_io->log_length - position < 2) {
+            replay_io->next.kind = REPLAY_EVENT_END;
+            return false;
+        }
+        event.value = replay_io_get(&log[position], 2);
+        position += 2;
+    } else if (event.kind == REPLAY_EVENT_PRESS) {
+        if (position == replay_io->log_length) {
+            replay_io->next.kind = REPLAY_EVENT_END;
+            return false;
+        }
+        event.value = log[position++];
+    } else if (event.kind != REPLAY_EVENT_END) {
+        replay_io->next.kind = REPLAY_EVENT_END;
+        return false;
+    }
+
+    replay_io->next = event;
+    replay_io->log_position = position;
+
+    return true;
+}
+
+//applies the key mask changes logged up to instruction_count
+static void replay_io_catch_up(replay_io_t *replay_io,
+                               uint64_t instruction_count) {
+    while (replay_io->next.kind == REPLAY_EVENT_KEYS &&
+           replay_io->next.instruction_count <= instruction_count)
+    {
+        replay_io->keyboard_mask = replay_io->next.value;
+        replay_io_read_event(replay_io);
+    }
+}
+
+static uint64_t replay_io_rom_hash(const rombuffer_t *rom) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = 0; i < rom->length; i++) {
+        hash ^= rom->data[i] >> 8;
+        hash *= FNV_PRIME;
+        hash ^= rom->data[i] & 0xFF;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static void replay_io_put(uint8_t *bytes, uint64_t value, uint8_t size) {
+    for (uint8_t i = 0; i < size; i++) {
+        bytes[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t replay_io_get(const uint8_t *bytes, uint8_t size) {
+    uint64_t value = 0;
+    for (uint8_t i = 0; i < size; i++) {
+        value |= (uint64_t)bytes[i] << (8 * i);
+    }
+
+    return value;
+}
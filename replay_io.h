@@ -0,0 +1,43 @@
+//replay_io.h
+
+#pragma once
+
+typedef struct replay_io replay_io_t;
+
+//pass a replay_io_t as the io context of cpu_new, then hand it the cpu
+//with replay_io_set_cpu before running
+extern const cpu_io_interface_t replay_io_interface;
+
+//passes inner through and logs every key mask change and key press it
+//delivers to path, keyed by instruction count
+replay_io_t *replay_io_new_recorder(const char *path,
+                                    const cpu_io_interface_t *inner,
+                                    void *inner_context,
+                                    const rombuffer_t *rom, uint64_t seed,
+                                    uint32_t ips);
+//feeds the input logged in path back to the cpu, frames still go to inner
+//unless it is NULL. fails if the log was recorded with a different rom
+replay_io_t *replay_io_new_player(const char *path,
+                                  const cpu_io_interface_t *inner,
+                                  void *inner_context,
+                                  const rombuffer_t *rom);
+int replay_io_set_cpu(replay_io_t *replay_io, const cpu_t *cpu);
+uint64_t replay_io_get_seed(const replay_io_t *replay_io);
+uint32_t replay_io_get_ips(const replay_io_t *replay_io);
+uint64_t replay_io_get_instruction_count(const replay_io_t *replay_io);
+bool replay_io_finished(const replay_io_t *replay_io);
+//a recorder must be freed before its cpu to log where the run ended
+void replay_io_free(replay_io_t *replay_io);
+
+//a replay matches the recording bit for bit when the cpu is seeded with
+//replay_io_get_seed and scheduled at replay_io_get_ips with one timer tick
+//per frame: turbo, or real time in lockstep. the engine does not matter.
+//replay_io_get_instruction_count is where the recording ended, or the
+//last event of a log that was cut short
+//
+//log format, little endian:
+//  32 byte header: magic "C8IR", version, seed, fnv-1a hash of the rom,
+//                  ips and 4 reserved bytes
+//  events:         LEB128 of (instructions since the previous event << 2 |
+//                  kind), then 2 bytes of key mask, 1 byte of pressed key
+//                  or nothing for the closing event
@@ -0,0 +1,380 @@
+//rewind_buffer.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "rewind_buffer.h"
+
+//a delta is a list of runs, each a run header followed by run.length
+//XORed bytes, and ends with an empty run. unchanged gaps shorter than a
+//header are folded into the surrounding runs
+typedef struct rewind_run {
+    uint16_t skip;                      //unchanged bytes before the run
+    uint16_t length;
+} rewind_run_t;
+
+typedef struct rewind_entry {
+    size_t offset;                      //into data
+    size_t length;
+    bool keyframe;
+} rewind_entry_t;
+
+typedef struct rewind_buffer {
+    size_t state_size;
+    uint8_t *current;                   //state of the newest frame
+    uint8_t *capture;                   //state being pushed
+    uint8_t *delta;                     //encoder output, 2 * state_size
+
+    //variable sized entries are packed in data as a ring. while wrapped,
+    //new entries go between head and the oldest entry, otherwise after
+    //head or, once the end is reached, from the start
+    uint8_t *data;
+    size_t data_size;
+    size_t head;
+    bool wrapped;
+
+    rewind_entry_t *entries;            //ring of max_frames
+    uint32_t max_frames;
+    uint32_t first;
+    uint32_t count;
+
+    uint32_t keyframe_interval;
+    uint32_t since_keyframe;            //deltas after the newest keyframe
+} rewind_buffer_t;
+
+static rewind_entry_t *rewind_buffer_entry(rewind_buffer_t *rewind_buffer,
+                                           uint32_t index);
+static size_t rewind_buffer_encode(rewind_buffer_t *rewind_buffer);
+static void rewind_buffer_apply(uint8_t *state, const uint8_t *delta);
+static bool rewind_buffer_alloc(rewind_buffer_t *rewind_buffer,
+                                size_t length, size_t *offset);
+static void rewind_buffer_drop_oldest(rewind_buffer_t *rewind_buffer);
+static void rewind_buffer_rebuild(rewind_buffer_t *rewind_buffer);
+
+rewind_buffer_t *rewind_buffer_new(size_t buffer_size, uint32_t max_frames,
+                                   uint32_t keyframe_interval) {
+    size_t state_size = cpu_state_size();
+    if (buffer_size < state_size || max_frames == 0 ||
+        keyframe_interval == 0)
+    {
+        return NULL;
+    }
+
+    rewind_buffer_t *rewind_buffer = calloc(1, sizeof(rewind_buffer_t));
+    if (rewind_buffer == NULL) {
+        return NULL;
+    }
+
+    rewind_buffer->state_size = state_size;
+    rewind_buffer->current = malloc(state_size);
+    rewind_buffer->capture = malloc(state_size);
+    rewind_buffer->delta = malloc(2 * state_size + sizeof(rewind_run_t));
+    rewind_buffer->data = malloc(buffer_size);
+    rewind_buffer->data_size = buffer_size;
+    rewind_buffer->entries = malloc(max_frames * sizeof(rewind_entry_t));
+    rewind_buffer->max_frames = max_frames;
+    rewind_buffer->keyframe_interval = keyframe_interval;
+
+    if (rewind_buffer->current == NULL || rewind_buffer->capture == NULL ||
+        rewind_buffer->delta == NULL || rewind_buffer->data == NULL ||
+        rewind_buffer->entries == NULL)
+    {
+        rewind_buffer_free(rewind_buffer);
+        return NULL;
+    }
+
+    return rewind_buffer;
+}
+
+//captures the cpu state as the newest frame
+int rewind_buffer_push(rewind_buffer_t *rewind_buffer, const cpu_t *cpu) {
+    if (rewind_buffer == NULL || cpu == NULL) {
+        return -1;
+    }
+
+    int error_code = cpu_save_state(cpu, rewind_buffer->capture,
+                                    rewind_buffer->state_size);
+    if (error_code) {
+        return error_code;
+    }
+
+    //deltas are only worth keeping while smaller than a keyframe
+    const uint8_t *source = rewind_buffer->capture;
+    size_t length = rewind_buffer->state_size;
+    bool keyframe = true;
+    if (rewind_buffer->count > 0 &&
+        rewind_buffer->since_keyframe + 1 < rewind_buffer->keyframe_interval)
+    {
+        size_t delta_length = rewind_buffer_encode(rewind_buffer);
+        if (delta_length < length) {
+            source = rewind_buffer->delta;
+            length = delta_length;
+            keyframe = false;
+        }
+    }
+
+    if (rewind_buffer->count == rewind_buffer->max_frames) {
+        rewind_buffer_drop_oldest(rewind_buffer);
+    }
+
+    size_t offset;
+    if (!rewind_buffer_alloc(rewind_buffer, length, &offset)) {
+        return -1;
+    }
+
+    //a delta whose keyframe was just dropped has nothing to apply to
+    if (!keyframe && rewind_buffer->count == 0) {
+        source = rewind_buffer->capture;
+        length = rewind_buffer->state_size;
+        keyframe = true;
+        if (!rewind_buffer_alloc(rewind_buffer, length, &offset)) {
+            return -1;
+        }
+    }
+
+    memcpy(&rewind_buffer->data[offset], source, length);
+    rewind_buffer->head = offset + length;
+
+    rewind_entry_t *entry = rewind_buffer_entry(rewind_buffer,
+                                                rewind_buffer->count);
+    entry->offset = offset;
+    entry->length = length;
+    entry->keyframe = keyframe;
+    rewind_buffer->count++;
+    rewind_buffer->since_keyframe = keyframe ? 0
+                                             : rewind_buffer->since_keyframe + 1;
+
+    memcpy(rewind_buffer->current, rewind_buffer->capture,
+           rewind_buffer->state_size);
+
+    return 0;
+}
+
+int rewind_buffer_step_back(rewind_buffer_t *rewind_buffer, cpu_t *cpu) {
+    if (rewind_buffer == NULL || cpu == NULL) {
+        return -1;
+    }
+
+    if (rewind_buffer->count == 0) {
+        return 1;
+    }
+
+    if (rewind_buffer->count > 1) {
+        rewind_entry_t *newest = rewind_buffer_entry(rewind_buffer,
+                                                     rewind_buffer->count - 1);
+
+        //XOR deltas undo themselves, a keyframe needs its predecessor
+        //rebuilt from the keyframe before it
+        rewind_buffer->count--;
+        rewind_buffer->head = newest->offset;
+        if (newest->keyframe) {
+            rewind_buffer_rebuild(rewind_buffer);
+        } else {
+            rewind_buffer_apply(rewind_buffer->current,
+                                &rewind_buffer->data[newest->offset]);
+            rewind_buffer->since_keyframe--;
+        }
+
+        //the head moved back past the wrap point
+        if (rewind_buffer->wrapped &&
+            rewind_buffer->head >= rewind_buffer_entry(rewind_buffer, 0)->offset)
+        {
+            rewind_buffer->wrapped = false;
+        }
+    }
+
+    return cpu_load_state(cpu, rewind_buffer->current,
+                          rewind_buffer->state_size);
+}
+
+uint32_t rewind_buffer_get_frame_count(const rewind_buffer_t *rewind_buffer) {
+    return rewind_buffer->count;
+}
+
+size_t rewind_buffer_get_bytes_used(const rewind_buffer_t *rewind_buffer) {
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < rewind_buffer->count; i++) {
+        bytes += rewind_buffer->entries[(rewind_buffer->first + i) %
+                                        rewind_buffer->max_frames].length;
+    }
+
+    return bytes;
+}
+
+void rewind_buffer_free(rewind_buffer_t *rewind_buffer) {
+    if (rewind_buffer == NULL) {
+        return;
+    }
+
+    free(rewind_buffer->current);
+    free(rewind_buffer->capture);
+    free(rewind_buffer->delta);
+    free(rewind_buffer->data);
+    free(rewind_buffer->entries);
+    free(rewind_buffer);
+}
+
+//index 0 is the oldest frame
+static rewind_entry_t *rewind_buffer_entry(rewind_buffer_t *rewind_buffer,
+                                           uint32_t index) {
+    return &rewind_buffer->entries[(rewind_buffer->first + index) %
+                                   rewind_buffer->max_frames];
+}
+
+//encodes capture XOR current into delta, returns its length
+static size_t rewind_buffer_encode(rewind_buffer_t *rewind_buffer) {
+    const uint8_t *old = rewind_buffer->current;
+    const uint8_t *new = rewind_buffer->capture;
+    size_t size = rewind_buffer->state_size;
+    uint8_t *out = rewind_buffer->delta;
+    size_t length = 0;
+    size_t position = 0;                //end of the previous run
+
+    size_t i = 0;
+    while (i < size) {
+        //skip unchanged bytes, eight at a time where possible
+        while (i + 8 <= size && !memcmp(&old[i], &new[i], 8)) {
+            i += 8;
+        }
+        while (i < size && old[i] == new[i]) {
+            i++;
+        }
+        if (i == size) {
+            break;
+        }
+
+        //extend the run until a gap long enough to pay for a new header
+        size_t start = i;
+        size_t end = i;
+        while (i < size && i - end <= sizeof(rewind_run_t)) {
+            if (old[i] != new[i]) {
+                end = i + 1;
+            }
+            i++;
+        }
+        if (end - start > UINT16_MAX) {
+            end = start + UINT16_MAX;
+        }
+        i = end;
+
+        rewind_run_t run = {
+            .skip = start - position,
+            .length = end - start
+        };
+        memcpy(&out[length], &run, sizeof(run));
+        length += sizeof(run);
+        for (size_t j = start; j < end; j++) {
+            out[length++] = old[j] ^ new[j];
+        }
+        position = end;
+
+        //bail out early, a keyframe is smaller
+        if (length >= size) {
+            return length;
+        }
+    }
+
+    rewind_run_t run = {0, 0};
+    memcpy(&out[length], &run, sizeof(run));
+
+    return length + sizeof(run);
+}
+
+//XORs an encoded delta into state, in either direction
+static void rewind_buffer_apply(uint8_t *state, const uint8_t *delta) {
+    size_t position = 0;
+
+    for (;;) {
+        rewind_run_t run;
+        memcpy(&run, delta, sizeof(run));
+        delta += sizeof(run);
+        if (run.length == 0) {
+            return;
+        }
+
+        position += run.skip;
+        for (uint16_t i = 0; i < run.length; i++) {
+            state[position + i] ^= delta[i];
+        }
+        position += run.length;
+        delta += run.length;
+    }
+}
+
+//finds room for length bytes in data, dropping the oldest frames as needed
+static bool rewind_buffer_alloc(rewind_buffer_t *rewind_buffer,
+                                size_t length, size_t *offset) {
+    if (length > rewind_buffer->data_size) {
+        return false;
+    }
+
+    for (;;) {
+        if (rewind_buffer->count == 0) {
+            rewind_buffer->head = 0;
+            rewind_buffer->wrapped = false;
+        }
+
+        size_t tail = rewind_buffer->count > 0
+                      ? rewind_buffer_entry(rewind_buffer, 0)->offset : 0;
+
+        if (!rewind_buffer->wrapped) {
+            if (rewind_buffer->head + length <= rewind_buffer->data_size) {
+                *offset = rewind_buffer->head;
+                return true;
+            }
+
+            if (length <= tail) {
+                rewind_buffer->wrapped = true;
+                *offset = 0;
+                return true;
+            }
+        } else if (rewind_buffer->head + length <= tail) {
+            *offset = rewind_buffer->head;
+            return true;
+        }
+
+        rewind_buffer_drop_oldest(rewind_buffer);
+    }
+}
+
+//drops the oldest keyframe and the deltas that depend on it
+static void rewind_buffer_drop_oldest(rewind_buffer_t *rewind_buffer) {
+    size_t old_tail = rewind_buffer_entry(rewind_buffer, 0)->offset;
+
+    do {
+        rewind_buffer->first = (rewind_buffer->first + 1) %
+                               rewind_buffer->max_frames;
+        rewind_buffer->count--;
+    } while (rewind_buffer->count > 0 &&
+             !rewind_buffer_entry(rewind_buffer, 0)->keyframe);
+
+    if (rewind_buffer->count == 0) {
+        rewind_buffer->since_keyframe = 0;
+    } else if (rewind_buffer->wrapped &&
+               rewind_buffer_entry(rewind_buffer, 0)->offset < old_tail)
+    {
+        rewind_buffer->wrapped = false;
+    }
+}
+
+//recomputes current for the newest frame from the keyframe before it
+static void rewind_buffer_rebuild(rewind_buffer_t *rewind_buffer) {
+    uint32_t keyframe = rewind_buffer->count - 1;
+    while (!rewind_buffer_entry(rewind_buffer, keyframe)->keyframe) {
+        keyframe--;
+    }
+
+    rewind_entry_t *entry = rewind_buffer_entry(rewind_buffer, keyframe);
+    memcpy(rewind_buffer->current, &rewind_buffer->data[entry->offset],
+           rewind_buffer->state_size);
+
+    for (uint32_t i = keyframe + 1; i < rewind_buffer->count; i++) {
+        entry = rewind_buffer_entry(rewind_buffer, i);
+        rewind_buffer_apply(rewind_buffer->current,
+                            &rewind_buffer->data[entry->offset]);
+    }
+
+    rewind_buffer->since_keyframe = rewind_buffer->count - 1 - keyframe;
+}
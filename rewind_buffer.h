@@ -0,0 +1,22 @@
+//rewind_buffer.h
+
+#pragma once
+
+typedef struct rewind_buffer rewind_buffer_t;
+
+//history of cpu save states, one per captured frame. every
+//keyframe_interval frames a full state is stored, the frames in between
+//hold sparse XOR deltas against the previous frame. the oldest keyframe
+//and its deltas are dropped once buffer_size bytes or max_frames are used
+rewind_buffer_t *rewind_buffer_new(size_t buffer_size, uint32_t max_frames,
+                                   uint32_t keyframe_interval);
+int rewind_buffer_push(rewind_buffer_t *rewind_buffer, const cpu_t *cpu);
+int rewind_buffer_step_back(rewind_buffer_t *rewind_buffer, cpu_t *cpu);
+uint32_t rewind_buffer_get_frame_count(const rewind_buffer_t *rewind_buffer);
+size_t rewind_buffer_get_bytes_used(const rewind_buffer_t *rewind_buffer);
+void rewind_buffer_free(rewind_buffer_t *rewind_buffer);
+
+//rewind_buffer_step_back discards the newest frame and loads the one
+//before it into cpu. with a single frame left it reloads that frame, with
+//none it returns 1 and leaves cpu alone. other errors are those of
+//cpu_save_state and cpu_load_state
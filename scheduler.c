@@ -0,0 +1,350 @@
+//scheduler.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+#include "scheduler.h"
+
+#define NS_PER_SECOND 1000000000ULL
+#define FRAME_NS (NS_PER_SECOND / SCHEDULER_TIMER_HZ)
+
+//a real time run further behind than this drops the missed bursts
+//instead of executing them back to back
+#define MAX_LAG_NS (4 * FRAME_NS)
+
+//DT and ST saturate after this many ticks
+#define MAX_PENDING_TICKS 0xFF
+
+typedef struct scheduler {
+    cpu_t *cpu;
+    uint32_t ips;
+    bool turbo;
+    bool lockstep;                      //one timer tick per frame, always
+
+    uint32_t cycle_remainder;           //ips carried into the next burst
+    uint64_t epoch;                     //timer tick 0, in ns
+    uint64_t deadline;                  //start of the next frame, in ns
+    uint64_t ticks;                     //timer ticks applied since epoch
+    uint64_t frames;
+    uint64_t idle_frames;               //frames cut short by an idle loop
+
+    uint32_t run_ahead;                 //speculative frames per frame
+    uint8_t *state;                     //cpu state to roll back to
+} scheduler_t;
+
+//what a burst does on reaching a key wait
+typedef enum scheduler_key_wait {
+    SCHEDULER_KEY_WAIT_BLOCK,           //presents, then blocks in it
+    SCHEDULER_KEY_WAIT_STALL,           //ends the burst, no key is held
+    SCHEDULER_KEY_WAIT_SPECULATE        //returns 1, the press is not known
+} scheduler_key_wait_t;
+
+static int scheduler_burst(cpu_t *cpu, uint32_t ips, uint32_t *remainder,
+                           scheduler_key_wait_t key_wait,
+                           uint64_t *idle_frames);
+static int scheduler_present(scheduler_t *scheduler, bool ticked);
+static uint64_t scheduler_now();
+static void scheduler_sleep_until(uint64_t deadline);
+static int scheduler_tick_timers(scheduler_t *scheduler, uint64_t now);
+
+scheduler_t *scheduler_new(cpu_t *cpu, uint32_t ips, bool turbo) {
+    if (cpu == NULL || ips == 0) {
+        return NULL;
+    }
+
+    scheduler_t *scheduler = malloc(sizeof(scheduler_t));
+    if (scheduler == NULL) {
+        return NULL;
+    }
+
+    scheduler->state = malloc(cpu_state_size());
+    if (scheduler->state == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+
+    scheduler->cpu = cpu;
+    scheduler->ips = ips;
+    scheduler->turbo = turbo;
+    scheduler->lockstep = false;
+    scheduler->cycle_remainder = 0;
+    scheduler->epoch = scheduler_now();
+    scheduler->deadline = scheduler->epoch;
+    scheduler->ticks = 0;
+    scheduler->frames = 0;
+    scheduler->idle_frames = 0;
+    scheduler->run_ahead = 0;
+
+    return scheduler;
+}
+
+int scheduler_set_lockstep(scheduler_t *scheduler, bool lockstep) {
+    if (scheduler == NULL) {
+        return -1;
+    }
+
+    scheduler->lockstep = lockstep;
+
+    return 0;
+}
+
+int scheduler_set_run_ahead(scheduler_t *scheduler, uint32_t frames) {
+    if (scheduler == NULL) {
+        return -1;
+    }
+
+    scheduler->run_ahead = frames;
+
+    return 0;
+}
+
+int scheduler_run_frame(scheduler_t *scheduler) {
+    if (scheduler == NULL) {
+        return -1;
+    }
+
+    int error_code = scheduler_burst(scheduler->cpu, scheduler->ips,
+                                     &scheduler->cycle_remainder,
+                                     SCHEDULER_KEY_WAIT_BLOCK,
+                                     &scheduler->idle_frames);
+    if (error_code) {
+        return error_code;
+    }
+
+    scheduler->frames++;
+
+    if (scheduler->turbo) {
+        error_code = cpu_decrement_timers(scheduler->cpu);
+        if (error_code) {
+            return error_code;
+        }
+
+        return scheduler_present(scheduler, true);
+    }
+
+    error_code = scheduler_present(scheduler, false);
+    if (error_code) {
+        return error_code;
+    }
+
+    scheduler->deadline += FRAME_NS;
+    uint64_t now = scheduler_now();
+    if (now > scheduler->deadline + MAX_LAG_NS) {
+        scheduler->deadline = now;
+    }
+
+    scheduler_sleep_until(scheduler->deadline);
+
+    //a late frame still gets exactly one tick, so the run depends only on
+    //the instructions executed and not on how the host kept up
+    if (scheduler->lockstep) {
+        scheduler->ticks = (scheduler_now() - scheduler->epoch) / FRAME_NS;
+        return cpu_decrement_timers(scheduler->cpu);
+    }
+
+    return scheduler_tick_timers(scheduler, scheduler_now());
+}
+
+//waits out one frame without running the cpu or ticking its timers, for
+//pauses and rewinding
+int scheduler_skip_frame(scheduler_t *scheduler) {
+    if (scheduler == NULL) {
+        return -1;
+    }
+
+    if (scheduler->turbo) {
+        return 0;
+    }
+
+    scheduler->deadline += FRAME_NS;
+    uint64_t now = scheduler_now();
+    if (now > scheduler->deadline + MAX_LAG_NS) {
+        scheduler->deadline = now;
+    }
+
+    scheduler_sleep_until(scheduler->deadline);
+    scheduler->ticks = (scheduler_now() - scheduler->epoch) / FRAME_NS;
+
+    return 0;
+}
+
+//one turbo frame of a cpu driven without a scheduler, for frontends that
+//step many machines and cannot block any of them. a key wait reached with
+//no key in keys ends the frame early and is resumed by a later one
+int scheduler_step_frame(cpu_t *cpu, uint32_t ips, uint32_t *remainder,
+                         uint16_t keys) {
+    if (cpu == NULL || remainder == NULL) {
+        return -1;
+    }
+
+    int error_code = scheduler_burst(cpu, ips, remainder,
+                                     keys ? SCHEDULER_KEY_WAIT_BLOCK :
+                                            SCHEDULER_KEY_WAIT_STALL,
+                                     NULL);
+    if (error_code) {
+        return error_code;
+    }
+
+    error_code = cpu_decrement_timers(cpu);
+    if (error_code) {
+        return error_code;
+    }
+
+    return cpu_present(cpu);
+}
+
+//the key a key wait takes when the keys in the mask are held
+uint8_t scheduler_lowest_key(uint16_t keys) {
+    if (keys == 0) {
+        return 0;
+    }
+
+    return __builtin_ctz(keys);
+}
+
+uint64_t scheduler_get_frame_count(const scheduler_t *scheduler) {
+    return scheduler->frames;
+}
+
+uint64_t scheduler_get_idle_frame_count(const scheduler_t *scheduler) {
+    return scheduler->idle_frames;
+}
+
+void scheduler_free(scheduler_t *scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+
+    free(scheduler->state);
+    free(scheduler);
+}
+
+//runs one frame worth of instructions, counting frames cut short by an
+//idle loop in idle_frames unless it is NULL
+static int scheduler_burst(cpu_t *cpu, uint32_t ips, uint32_t *remainder,
+                           scheduler_key_wait_t key_wait,
+                           uint64_t *idle_frames) {
+    //spread ips over the frames without losing the remainder
+    *remainder += ips;
+    uint32_t burst = *remainder / SCHEDULER_TIMER_HZ;
+    *remainder %= SCHEDULER_TIMER_HZ;
+
+    while (burst > 0) {
+        if (cpu_key_wait_pending(cpu)) {
+            if (key_wait == SCHEDULER_KEY_WAIT_SPECULATE) {
+                return 1;
+            }
+            if (key_wait == SCHEDULER_KEY_WAIT_STALL) {
+                break;
+            }
+
+            //the run blocks in the key wait, so show what was drawn
+            //before it
+            int error_code = cpu_present(cpu);
+            if (error_code) {
+                return error_code;
+            }
+        }
+
+        cpu_run_result_t result;
+        int error_code = cpu_run(cpu, burst, &result);
+        if (error_code) {
+            return error_code;
+        }
+
+        burst -= result.cycles;
+
+        //the loop cannot make progress before the next timer tick or key
+        //press, so the rest of the burst is skipped and the host sleeps
+        if (result.stop_reason == CPU_STOP_IDLE) {
+            if (idle_frames != NULL) {
+                (*idle_frames)++;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+//presents the frame, or with run ahead the one run_ahead frames later with
+//the keys held now, then rolls the cpu back. ticked tells whether the
+//timers were already ticked for the current frame
+static int scheduler_present(scheduler_t *scheduler, bool ticked) {
+    if (scheduler->run_ahead == 0) {
+        return cpu_present(scheduler->cpu);
+    }
+
+    size_t state_size = cpu_state_size();
+    int error_code = cpu_save_state(scheduler->cpu, scheduler->state,
+                                    state_size);
+    if (error_code) {
+        return error_code;
+    }
+
+    //speculation stops at a key wait or an error, the real run deals with
+    //them when it gets there
+    uint32_t remainder = scheduler->cycle_remainder;
+    for (uint32_t frame = 0; frame < scheduler->run_ahead; frame++) {
+        if (!ticked && cpu_decrement_timers(scheduler->cpu)) {
+            break;
+        }
+
+        if (scheduler_burst(scheduler->cpu, scheduler->ips, &remainder,
+                            SCHEDULER_KEY_WAIT_SPECULATE, NULL))
+        {
+            break;
+        }
+
+        if (ticked && cpu_decrement_timers(scheduler->cpu)) {
+            break;
+        }
+    }
+
+    error_code = cpu_present(scheduler->cpu);
+    if (error_code) {
+        return error_code;
+    }
+
+    return cpu_load_state(scheduler->cpu, scheduler->state, state_size);
+}
+
+static uint64_t scheduler_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+}
+
+static void scheduler_sleep_until(uint64_t deadline) {
+    struct timespec target = {
+        .tv_sec = deadline / NS_PER_SECOND,
+        .tv_nsec = deadline % NS_PER_SECOND
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) ==
+           EINTR);
+}
+
+//applies every 60 Hz tick that elapsed since the previous call
+static int scheduler_tick_timers(scheduler_t *scheduler, uint64_t now) {
+    uint64_t due = (now - scheduler->epoch) / FRAME_NS;
+    if (due - scheduler->ticks > MAX_PENDING_TICKS) {
+        scheduler->ticks = due - MAX_PENDING_TICKS;
+    }
+
+    while (scheduler->ticks < due) {
+        int error_code = cpu_decrement_timers(scheduler->cpu);
+        if (error_code) {
+            return error_code;
+        }
+
+        scheduler->ticks++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+//scheduler.h
+
+#pragma once
+
+#define SCHEDULER_TIMER_HZ 60
+
+typedef struct scheduler scheduler_t;
+
+//runs a cpu at a fixed number of instructions per second, one burst per
+//60 Hz frame. in real time mode frames start on absolute wall clock
+//deadlines and DT/ST tick from elapsed time, so a frame that blocks in a
+//key wait does not stall the timers. turbo never sleeps and ticks the
+//timers once per emulated frame
+scheduler_t *scheduler_new(cpu_t *cpu, uint32_t ips, bool turbo);
+//lockstep makes real time mode tick the timers once per frame like turbo,
+//so a run can be reproduced from its key input alone
+int scheduler_set_lockstep(scheduler_t *scheduler, bool lockstep);
+//run ahead presents the frame the given number of frames in the future,
+//emulated with the keys held now and then rolled back, hiding that much
+//input latency at the cost of running every frame that many extra times.
+//the io backend must not count on the key reads it sees being final
+int scheduler_set_run_ahead(scheduler_t *scheduler, uint32_t frames);
+int scheduler_run_frame(scheduler_t *scheduler);
+int scheduler_skip_frame(scheduler_t *scheduler);
+//servers stepping many cpus without a scheduler each, see the notes below
+int scheduler_step_frame(cpu_t *cpu, uint32_t ips, uint32_t *remainder,
+                         uint16_t keys);
+uint8_t scheduler_lowest_key(uint16_t keys);
+uint64_t scheduler_get_frame_count(const scheduler_t *scheduler);
+uint64_t scheduler_get_idle_frame_count(const scheduler_t *scheduler);
+void scheduler_free(scheduler_t *scheduler);
+
+//scheduler_run_frame returns the error code of the failing cpu method
+//
+//scheduler_step_frame runs cpu like one turbo frame, carrying the ips
+//remainder in *remainder, but ends the frame at a key wait while keys is 0
+//instead of blocking in it, so a later call resumes there. keys is what
+//the io backend reports held, and its wait_keypress should return
+//scheduler_lowest_key of the same mask, which is 0 for an empty mask. it
+//returns -1 for NULL arguments and otherwise the error code of the
+//failing cpu method
@@ -1,20 +1,41 @@
 //sdl_io.c
 
+#include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include "cpu.h"
+#include "triplebuffer.h"
 #include "sdl_io.h"
 
 #define PIXEL_WIDTH 15
-
-static SDL_Window *win;
-static SDL_Renderer *renderer;
-static pthread_mutex_t mutex_sdl = PTHREAD_MUTEX_INITIALIZER;
-static const uint8_t *keyboard_state;
-static uint32_t current_wait_key;
-static bool pixel_map[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+#define PIXEL_ON 0xFF00FF00     //ARGB8888
+#define PIXEL_OFF 0xFF000000
+#define UI_POLL_US 10000
+
+typedef struct sdl_io {
+    SDL_Window *win;
+    Uint32 window_id;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;               //DISPLAY_WIDTH x DISPLAY_HEIGHT
+    bool vsync_enabled;
+
+    atomic_uint_least16_t keyboard_mask;    //published by the ui thread
+    pthread_mutex_t mutex_keys;
+    pthread_cond_t key_pressed;
+    int pending_key;                    //hex key pressed, -1 for none
+    bool quit_requested;
+    atomic_int hotkey;                  //sdl_io_hotkey_t, taken by the cpu
+    atomic_bool rewind_held;
+
+    triplebuffer_t *frames;             //cpu thread -> ui thread
+    uint32_t pixels[DISPLAY_HEIGHT][DISPLAY_WIDTH]; //owned by the ui thread
+    bool redraw;                        //window needs the last frame again
+    bool closed;                        //owned by the ui thread
+} sdl_io_t;
 
 enum key_map {
     KEY_MAP_1 = SDL_SCANCODE_6,
@@ -35,6 +56,12 @@ enum key_map {
     KEY_MAP_F = SDL_SCANCODE_PERIOD
 };
 
+enum hotkey_map {
+    HOTKEY_MAP_SAVE_STATE = SDLK_F5,
+    HOTKEY_MAP_LOAD_STATE = SDLK_F9,
+    HOTKEY_MAP_REWIND = SDLK_BACKSPACE
+};
+
 enum key_wait {
     KEY_WAIT_1 = SDLK_6,
     KEY_WAIT_2 = SDLK_7,
@@ -54,22 +81,54 @@ enum key_wait {
     KEY_WAIT_F = SDLK_PERIOD
 };
 
-static uint16_t sdl_io_get_keyboard();
-static uint8_t sdl_io_wait_keypress();
-static bool sdl_io_get_pixel(uint8_t x, uint8_t y);
-static void sdl_io_draw_pixel(uint8_t x, uint8_t y, bool fill);
+static uint16_t sdl_io_get_keyboard(void *context);
+static uint8_t sdl_io_wait_keypress(void *context);
+static void sdl_io_present_frame(void *context,
+                                 const uint64_t display[DISPLAY_HEIGHT],
+                                 uint32_t dirty_rows);
+static sdl_io_t *sdl_io_find(sdl_io_t *const sdl_ios[], size_t count,
+                             Uint32 window_id);
+static void sdl_io_request_quit(sdl_io_t *sdl_io);
+static void sdl_io_press_key(sdl_io_t *sdl_io, SDL_Keycode keycode);
+static uint16_t sdl_io_read_keyboard(const uint8_t *keyboard_state);
+static int sdl_io_hex_key(SDL_Keycode keycode);
+static void sdl_io_render(sdl_io_t *sdl_io,
+                          const uint64_t display[DISPLAY_HEIGHT],
+                          uint32_t dirty_rows);
 
 const cpu_io_interface_t sdl_io_interface = {
     .get_keyboard = sdl_io_get_keyboard, 
     .wait_keypress = sdl_io_wait_keypress,
-    .get_pixel = sdl_io_get_pixel,
-    .draw_pixel = sdl_io_draw_pixel
+    .present_frame = sdl_io_present_frame
 };
 
-void sdl_io_init(const char *game_title) {
-    SDL_Init(SDL_INIT_VIDEO);
+sdl_io_t *sdl_io_new(const char *game_title, bool vsync) {
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO)) {
+        printf("Error initializing video: %s\n", SDL_GetError());
+        return NULL;
+    }
+
+    sdl_io_t *sdl_io = calloc(1, sizeof(sdl_io_t));
+    if (sdl_io == NULL) {
+        SDL_QuitSubSystem(SDL_INIT_VIDEO);
+        return NULL;
+    }
+
+    atomic_init(&sdl_io->keyboard_mask, 0);
+    atomic_init(&sdl_io->hotkey, SDL_IO_HOTKEY_NONE);
+    atomic_init(&sdl_io->rewind_held, false);
+    pthread_mutex_init(&sdl_io->mutex_keys, NULL);
+    pthread_cond_init(&sdl_io->key_pressed, NULL);
+    sdl_io->pending_key = -1;
+
+    sdl_io->frames = triplebuffer_new();
+    if (sdl_io->frames == NULL) {
+        printf("Error creating frame buffers\n");
+        sdl_io_free(sdl_io);
+        return NULL;
+    }
 
-    win = SDL_CreateWindow(
+    sdl_io->win = SDL_CreateWindow(
         game_title,
         SDL_WINDOWPOS_UNDEFINED, 
         SDL_WINDOWPOS_UNDEFINED,
@@ -77,82 +136,284 @@ void sdl_io_init(const char *game_title) {
         DISPLAY_HEIGHT * PIXEL_WIDTH,
         0
     );
-    if (win == NULL) {
+    if (sdl_io->win == NULL) {
         printf("Error creating window: %s\n", SDL_GetError());
-        return;
+        sdl_io_free(sdl_io);
+        return NULL;
     }
-
-    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_SOFTWARE);
-    if (renderer == NULL) {
+    sdl_io->window_id = SDL_GetWindowID(sdl_io->win);
+
+    //prefer the gpu, fall back to the software renderer without vsync
+    sdl_io->vsync_enabled = vsync;
+    sdl_io->renderer = SDL_CreateRenderer(sdl_io->win, -1,
+                                          SDL_RENDERER_ACCELERATED |
+                                          (vsync ? SDL_RENDERER_PRESENTVSYNC
+                                                 : 0));
+    if (sdl_io->renderer == NULL) {
+        sdl_io->vsync_enabled = false;
+        sdl_io->renderer = SDL_CreateRenderer(sdl_io->win, -1,
+                                              SDL_RENDERER_SOFTWARE);
+    }
+    if (sdl_io->renderer == NULL) {
         printf("Error creating renderer: %s\n", SDL_GetError());
+        sdl_io_free(sdl_io);
+        return NULL;
+    }
+
+    //the display is uploaded at native size and scaled by the renderer
+    sdl_io->texture = SDL_CreateTexture(sdl_io->renderer,
+                                        SDL_PIXELFORMAT_ARGB8888,
+                                        SDL_TEXTUREACCESS_STREAMING,
+                                        DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    if (sdl_io->texture == NULL) {
+        printf("Error creating texture: %s\n", SDL_GetError());
+        sdl_io_free(sdl_io);
+        return NULL;
+    }
+
+    //frames only upload their changed rows, so start from a blank texture
+    for (int i = 0; i < DISPLAY_HEIGHT; i++) {
+        for (int j = 0; j < DISPLAY_WIDTH; j++) {
+            sdl_io->pixels[i][j] = PIXEL_OFF;
+        }
     }
+    SDL_UpdateTexture(sdl_io->texture, NULL, sdl_io->pixels,
+                      sizeof(sdl_io->pixels[0]));
 
     //clear game screen to black
-    SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0x00);
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
+    SDL_SetRenderDrawColor(sdl_io->renderer, 0x00, 0x00, 0x00, 0x00);
+    SDL_RenderClear(sdl_io->renderer);
+    SDL_RenderPresent(sdl_io->renderer);
+
+    return sdl_io;
+}
+
+void sdl_io_free(sdl_io_t *sdl_io) {
+    if (sdl_io == NULL) {
+        return;
+    }
+
+    triplebuffer_free(sdl_io->frames);
+
+    if (sdl_io->texture != NULL) {
+        SDL_DestroyTexture(sdl_io->texture);
+    }
+    if (sdl_io->renderer != NULL) {
+        SDL_DestroyRenderer(sdl_io->renderer);
+    }
+    if (sdl_io->win != NULL) {
+        SDL_DestroyWindow(sdl_io->win);
+    }
+
+    pthread_cond_destroy(&sdl_io->key_pressed);
+    pthread_mutex_destroy(&sdl_io->mutex_keys);
+    free(sdl_io);
+
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+}
+
+//returns the last hotkey pressed since the previous call
+sdl_io_hotkey_t sdl_io_take_hotkey(sdl_io_t *sdl_io) {
+    return atomic_exchange(&sdl_io->hotkey, SDL_IO_HOTKEY_NONE);
 }
 
-void sdl_io_terminate() {
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(win);
-    SDL_Quit();
+bool sdl_io_rewind_held(sdl_io_t *sdl_io) {
+    return atomic_load(&sdl_io->rewind_held);
 }
 
-void sdl_ui_run() {
-    bool quit = false;
+void sdl_io_get_stats(sdl_io_t *sdl_io, triplebuffer_stats_t *stats) {
+    triplebuffer_get_stats(sdl_io->frames, stats);
+}
+
+//SDL has one event queue per process, so a single ui thread pumps it for
+//every instance and routes events by window
+void sdl_io_run(sdl_io_t *const sdl_ios[], size_t count) {
+    size_t open_windows = count;
     SDL_Event event;
 
-    while (!quit) {
-        pthread_mutex_lock(&mutex_sdl);
+    while (open_windows > 0) {
         while (SDL_PollEvent(&event)) {
+            sdl_io_t *target = NULL;
+
             if (event.type == SDL_QUIT) {
-                quit = true;
-                current_wait_key = KEY_WAIT_0;
+                for (size_t i = 0; i < count; i++) {
+                    sdl_io_request_quit(sdl_ios[i]);
+                }
+            }
+
+            if (event.type == SDL_WINDOWEVENT) {
+                target = sdl_io_find(sdl_ios, count, event.window.windowID);
+                if (target != NULL &&
+                    event.window.event == SDL_WINDOWEVENT_CLOSE)
+                {
+                    sdl_io_request_quit(target);
+                } else if (target != NULL) {
+                    //exposed or resized windows need the last frame again
+                    target->redraw = true;
+                }
             }
 
             if (event.type == SDL_KEYDOWN) {
-                current_wait_key = event.key.keysym.sym;
+                target = sdl_io_find(sdl_ios, count, event.key.windowID);
+                if (target != NULL) {
+                    sdl_io_press_key(target, event.key.keysym.sym);
+                }
+            }
+
+            if (event.type == SDL_KEYUP &&
+                event.key.keysym.sym == HOTKEY_MAP_REWIND)
+            {
+                target = sdl_io_find(sdl_ios, count, event.key.windowID);
+                if (target != NULL) {
+                    atomic_store(&target->rewind_held, false);
+                }
             }
         }
-        
-        keyboard_state = SDL_GetKeyboardState(NULL);
 
-        SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0x00);
-        SDL_RenderClear(renderer);
+        //the keyboard state belongs to whichever window has focus
+        uint16_t keys = sdl_io_read_keyboard(SDL_GetKeyboardState(NULL));
+        SDL_Window *focus = SDL_GetKeyboardFocus();
 
-        SDL_Rect square_pixel = {
-            0,
-            0,
-            PIXEL_WIDTH,
-            PIXEL_WIDTH
-        };
+        bool presented = false;
+        open_windows = 0;
+        for (size_t i = 0; i < count; i++) {
+            sdl_io_t *sdl_io = sdl_ios[i];
+            if (sdl_io->closed) {
+                continue;
+            }
+            open_windows++;
 
-        for (int i = 0; i < DISPLAY_HEIGHT; i++) {
-            for (int j = 0; j < DISPLAY_WIDTH; j++) {
-                square_pixel.x = j * PIXEL_WIDTH;
-                square_pixel.y = i * PIXEL_WIDTH;
+            atomic_store(&sdl_io->keyboard_mask,
+                         sdl_io->win == focus ? keys : 0);
 
-                if (pixel_map[i][j]) {
-                    SDL_SetRenderDrawColor(renderer, 0x00, 0xFF, 0x00, 0x00);
-                } else {
-                    SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0x00);
-                }
+            //nothing is presented until the cpu thread publishes a new frame
+            uint32_t dirty_rows;
+            const uint64_t *frame = triplebuffer_acquire(sdl_io->frames,
+                                                         &dirty_rows);
+            if (frame != NULL) {
+                sdl_io_render(sdl_io, frame, dirty_rows);
+            }
 
-                SDL_RenderFillRect(renderer, &square_pixel);
+            if (frame != NULL || sdl_io->redraw) {
+                SDL_RenderClear(sdl_io->renderer);
+                SDL_RenderCopy(sdl_io->renderer, sdl_io->texture, NULL, NULL);
+                SDL_RenderPresent(sdl_io->renderer);
+                sdl_io->redraw = false;
+                presented |= sdl_io->vsync_enabled;
             }
         }
 
-        SDL_RenderPresent(renderer);
-        pthread_mutex_unlock(&mutex_sdl);
-        usleep(10000);
+        //a vsync present already waited for the next refresh
+        if (!presented) {
+            usleep(UI_POLL_US);
+        }
     }
 }
 
-static uint16_t sdl_io_get_keyboard() {
+static sdl_io_t *sdl_io_find(sdl_io_t *const sdl_ios[], size_t count,
+                             Uint32 window_id) {
+    for (size_t i = 0; i < count; i++) {
+        if (sdl_ios[i]->window_id == window_id) {
+            return sdl_ios[i];
+        }
+    }
+
+    return NULL;
+}
+
+//marks the window closed and releases a cpu thread blocked in
+//sdl_io_wait_keypress
+static void sdl_io_request_quit(sdl_io_t *sdl_io) {
+    sdl_io->closed = true;
+    atomic_store(&sdl_io->keyboard_mask, 0);
+    atomic_store(&sdl_io->rewind_held, false);
+
+    pthread_mutex_lock(&sdl_io->mutex_keys);
+    sdl_io->quit_requested = true;
+    pthread_cond_broadcast(&sdl_io->key_pressed);
+    pthread_mutex_unlock(&sdl_io->mutex_keys);
+}
+
+static void sdl_io_press_key(sdl_io_t *sdl_io, SDL_Keycode keycode) {
+    //hotkeys are only flagged here, the cpu thread acts on them
+    if (keycode == HOTKEY_MAP_SAVE_STATE) {
+        atomic_store(&sdl_io->hotkey, SDL_IO_HOTKEY_SAVE_STATE);
+        return;
+    }
+    if (keycode == HOTKEY_MAP_LOAD_STATE) {
+        atomic_store(&sdl_io->hotkey, SDL_IO_HOTKEY_LOAD_STATE);
+        return;
+    }
+    if (keycode == HOTKEY_MAP_REWIND) {
+        atomic_store(&sdl_io->rewind_held, true);
+        return;
+    }
+
+    int hex_key = sdl_io_hex_key(keycode);
+    if (hex_key < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&sdl_io->mutex_keys);
+    sdl_io->pending_key = hex_key;
+    pthread_cond_signal(&sdl_io->key_pressed);
+    pthread_mutex_unlock(&sdl_io->mutex_keys);
+}
+
+//expands the changed rows of the packed display into texture pixels and
+//uploads each run of adjacent changed rows with one update
+static void sdl_io_render(sdl_io_t *sdl_io,
+                          const uint64_t display[DISPLAY_HEIGHT],
+                          uint32_t dirty_rows) {
+    while (dirty_rows) {
+        int first = __builtin_ctz(dirty_rows);
+        int last = first;
+        while (last < DISPLAY_HEIGHT && (dirty_rows & (1U << last))) {
+            uint64_t row = display[last];
+            for (int j = 0; j < DISPLAY_WIDTH; j++) {
+                sdl_io->pixels[last][j] = (row & (1ULL << (63 - j)))
+                                          ? PIXEL_ON : PIXEL_OFF;
+            }
+            dirty_rows &= ~(1U << last);
+            last++;
+        }
+
+        SDL_Rect rows = {0, first, DISPLAY_WIDTH, last - first};
+        SDL_UpdateTexture(sdl_io->texture, &rows, sdl_io->pixels[first],
+                          sizeof(sdl_io->pixels[0]));
+    }
+}
+
+static uint16_t sdl_io_get_keyboard(void *context) {
+    sdl_io_t *sdl_io = context;
+
+    return atomic_load(&sdl_io->keyboard_mask);
+}
+
+//sleeps until the ui thread reports a key press, returns 0 after quit
+static uint8_t sdl_io_wait_keypress(void *context) {
+    sdl_io_t *sdl_io = context;
+    uint8_t return_value;
+
+    pthread_mutex_lock(&sdl_io->mutex_keys);
+    while (sdl_io->pending_key < 0 && !sdl_io->quit_requested) {
+        pthread_cond_wait(&sdl_io->key_pressed, &sdl_io->mutex_keys);
+    }
+
+    if (sdl_io->quit_requested) {
+        return_value = 0x00;
+    } else {
+        return_value = sdl_io->pending_key;
+    }
+    sdl_io->pending_key = -1;
+    pthread_mutex_unlock(&sdl_io->mutex_keys);
+
+    return return_value;
+}
+
+static uint16_t sdl_io_read_keyboard(const uint8_t *keyboard_state) {
     uint16_t hex_keys = 0;
 
-    pthread_mutex_lock(&mutex_sdl);
     if (keyboard_state[KEY_MAP_1]) {
         hex_keys |= 1 << 0x01;
     }
@@ -201,94 +462,54 @@ static uint16_t sdl_io_get_keyboard() {
     if (keyboard_state[KEY_MAP_F]) {
         hex_keys |= 1 << 0x0F;
     }
-    pthread_mutex_unlock(&mutex_sdl);
 
     return hex_keys;
 }
 
-static uint8_t sdl_io_wait_keypress() {
-    uint8_t return_value;
-    bool unacceptable = true;
-
-    while (unacceptable) {
-        unacceptable = false;
-
-        pthread_mutex_lock(&mutex_sdl);
-        switch (current_wait_key) {
-            case KEY_WAIT_1:
-                return_value = 0x01;
-                break;
-            case KEY_WAIT_2:
-                return_value = 0x02;
-                break;
-            case KEY_WAIT_3:
-                return_value = 0x03;
-                break;
-            case KEY_WAIT_C:
-                return_value = 0x0C;
-                break;
-            case KEY_WAIT_4:
-                return_value = 0x04;
-                break;
-            case KEY_WAIT_5:
-                return_value = 0x05;
-                break;
-            case KEY_WAIT_6:
-                return_value = 0x06;
-                break;
-            case KEY_WAIT_D:
-                return_value = 0x0D;
-                break;
-            case KEY_WAIT_7:
-                return_value = 0x07;
-                break;
-            case KEY_WAIT_8:
-                return_value = 0x08;
-                break;
-            case KEY_WAIT_9:
-                return_value = 0x09;
-                break;
-            case KEY_WAIT_E:
-                return_value = 0x0E;
-                break;
-            case KEY_WAIT_A:
-                return_value = 0x0A;
-                break;
-            case KEY_WAIT_0:
-                return_value = 0x00;
-                break;
-            case KEY_WAIT_B:
-                return_value = 0x0B;
-                break;
-            case KEY_WAIT_F:
-                return_value = 0x0F;
-                break;
-            default:
-                unacceptable = true;
-        }
-        current_wait_key = SDLK_UNKNOWN;
-        pthread_mutex_unlock(&mutex_sdl);
+//returns the hex key mapped to keycode, or -1
+static int sdl_io_hex_key(SDL_Keycode keycode) {
+    switch (keycode) {
+        case KEY_WAIT_1:
+            return 0x01;
+        case KEY_WAIT_2:
+            return 0x02;
+        case KEY_WAIT_3:
+            return 0x03;
+        case KEY_WAIT_C:
+            return 0x0C;
+        case KEY_WAIT_4:
+            return 0x04;
+        case KEY_WAIT_5:
+            return 0x05;
+        case KEY_WAIT_6:
+            return 0x06;
+        case KEY_WAIT_D:
+            return 0x0D;
+        case KEY_WAIT_7:
+            return 0x07;
+        case KEY_WAIT_8:
+            return 0x08;
+        case KEY_WAIT_9:
+            return 0x09;
+        case KEY_WAIT_E:
+            return 0x0E;
+        case KEY_WAIT_A:
+            return 0x0A;
+        case KEY_WAIT_0:
+            return 0x00;
+        case KEY_WAIT_B:
+            return 0x0B;
+        case KEY_WAIT_F:
+            return 0x0F;
+        default:
+            return -1;
     }
-
-    return return_value;
 }
 
-static bool sdl_io_get_pixel(uint8_t x, uint8_t y) {
-    bool return_value;
-
-    pthread_mutex_lock(&mutex_sdl);
-    if (pixel_map[y][x]) {
-        return_value = true;
-    } else {
-        return_value = false; 
-    }
-    pthread_mutex_unlock(&mutex_sdl);
-
-    return return_value;
-}
+static void sdl_io_present_frame(void *context,
+                                 const uint64_t display[DISPLAY_HEIGHT],
+                                 uint32_t dirty_rows) {
+    sdl_io_t *sdl_io = context;
 
-static void sdl_io_draw_pixel(uint8_t x, uint8_t y, bool fill) {
-    pthread_mutex_lock(&mutex_sdl);
-        pixel_map[y][x] = fill;
-    pthread_mutex_unlock(&mutex_sdl);
+    triplebuffer_publish(sdl_io->frames, display, dirty_rows);
 }
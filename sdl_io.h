@@ -2,8 +2,27 @@
 
 #pragma once
 
+typedef struct sdl_io sdl_io_t;
+
+typedef enum sdl_io_hotkey {
+    SDL_IO_HOTKEY_NONE,
+    SDL_IO_HOTKEY_SAVE_STATE,           //F5
+    SDL_IO_HOTKEY_LOAD_STATE            //F9
+} sdl_io_hotkey_t;
+
+//pass an sdl_io_t as the io context of cpu_new
 extern const cpu_io_interface_t sdl_io_interface;
 
-void sdl_io_init(const char *game_title);
-void sdl_io_terminate();
-void sdl_ui_run();
+//vsync paces presentation to the display refresh when the renderer allows
+sdl_io_t *sdl_io_new(const char *game_title, bool vsync);
+void sdl_io_free(sdl_io_t *sdl_io);
+void sdl_io_run(sdl_io_t *const sdl_ios[], size_t count);
+sdl_io_hotkey_t sdl_io_take_hotkey(sdl_io_t *sdl_io);
+bool sdl_io_rewind_held(sdl_io_t *sdl_io);     //backspace
+void sdl_io_get_stats(sdl_io_t *sdl_io, triplebuffer_stats_t *stats);
+
+//sdl_io_run pumps events and renders for every instance given, and returns
+//once all their windows are closed. it need not run on the thread that
+//created them: main.c creates its instance on the main thread, runs it on
+//a separate ui thread and frees it after joining that thread. only one
+//thread may run sdl_io_run at a time
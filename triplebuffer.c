@@ -0,0 +1,118 @@
+//triplebuffer.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "cpu.h"
+#include "triplebuffer.h"
+
+#define TRIPLEBUFFER_FRESH 0x04         //set in middle while it is unread
+#define TRIPLEBUFFER_INDEX 0x03
+
+typedef struct triplebuffer {
+    uint64_t frames[3][DISPLAY_HEIGHT];
+    uint32_t dirty_rows[3];             //rows changed since the last acquire
+
+    //index of the buffer in the middle, swapped by both sides
+    atomic_uint middle;
+
+    //owned by the producer and the consumer respectively
+    unsigned int back;
+    unsigned int front;
+    uint32_t published_rows;            //dirty_rows of the last publish
+
+    atomic_uint_fast64_t published;
+    atomic_uint_fast64_t acquired;
+    atomic_uint_fast64_t dropped;
+} triplebuffer_t;
+
+triplebuffer_t *triplebuffer_new() {
+    triplebuffer_t *triplebuffer = calloc(1, sizeof(triplebuffer_t));
+    if (triplebuffer == NULL) {
+        return NULL;
+    }
+
+    triplebuffer->back = 0;
+    atomic_init(&triplebuffer->middle, 1);
+    triplebuffer->front = 2;
+
+    atomic_init(&triplebuffer->published, 0);
+    atomic_init(&triplebuffer->acquired, 0);
+    atomic_init(&triplebuffer->dropped, 0);
+
+    return triplebuffer;
+}
+
+void triplebuffer_publish(triplebuffer_t *triplebuffer,
+                          const uint64_t frame[DISPLAY_HEIGHT],
+                          uint32_t dirty_rows) {
+    if (triplebuffer == NULL || frame == NULL) {
+        return;
+    }
+
+    //an unread frame may be dropped by this publish, so its rows carry
+    //over. if the consumer takes it meanwhile they are only redrawn twice
+    if (atomic_load(&triplebuffer->middle) & TRIPLEBUFFER_FRESH) {
+        dirty_rows |= triplebuffer->published_rows;
+    }
+    triplebuffer->published_rows = dirty_rows;
+
+    memcpy(triplebuffer->frames[triplebuffer->back], frame,
+           sizeof(triplebuffer->frames[0]));
+    triplebuffer->dirty_rows[triplebuffer->back] = dirty_rows;
+
+    unsigned int previous = atomic_exchange(&triplebuffer->middle,
+                                            triplebuffer->back |
+                                            TRIPLEBUFFER_FRESH);
+    if (previous & TRIPLEBUFFER_FRESH) {
+        atomic_fetch_add_explicit(&triplebuffer->dropped, 1,
+                                  memory_order_relaxed);
+    }
+
+    triplebuffer->back = previous & TRIPLEBUFFER_INDEX;
+    atomic_fetch_add_explicit(&triplebuffer->published, 1,
+                              memory_order_relaxed);
+}
+
+const uint64_t *triplebuffer_acquire(triplebuffer_t *triplebuffer,
+                                     uint32_t *dirty_rows) {
+    if (triplebuffer == NULL) {
+        return NULL;
+    }
+
+    if (!(atomic_load(&triplebuffer->middle) & TRIPLEBUFFER_FRESH)) {
+        return NULL;
+    }
+
+    unsigned int previous = atomic_exchange(&triplebuffer->middle,
+                                            triplebuffer->front);
+    triplebuffer->front = previous & TRIPLEBUFFER_INDEX;
+    atomic_fetch_add_explicit(&triplebuffer->acquired, 1,
+                              memory_order_relaxed);
+
+    if (dirty_rows != NULL) {
+        *dirty_rows = triplebuffer->dirty_rows[triplebuffer->front];
+    }
+
+    return triplebuffer->frames[triplebuffer->front];
+}
+
+void triplebuffer_get_stats(triplebuffer_t *triplebuffer,
+                            triplebuffer_stats_t *stats) {
+    if (triplebuffer == NULL || stats == NULL) {
+        return;
+    }
+
+    stats->published = atomic_load_explicit(&triplebuffer->published,
+                                             memory_order_relaxed);
+    stats->acquired = atomic_load_explicit(&triplebuffer->acquired,
+                                           memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&triplebuffer->dropped,
+                                          memory_order_relaxed);
+}
+
+void triplebuffer_free(triplebuffer_t *triplebuffer) {
+    free(triplebuffer);
+}
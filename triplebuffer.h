@@ -0,0 +1,30 @@
+//triplebuffer.h
+
+#pragma once
+
+typedef struct triplebuffer triplebuffer_t;
+
+typedef struct triplebuffer_stats {
+    uint64_t published;         //frames handed over by the producer
+    uint64_t acquired;          //frames picked up by the consumer
+    uint64_t dropped;           //frames replaced before they were picked up
+} triplebuffer_stats_t;
+
+//single producer, single consumer frame handoff without locks. the
+//producer always has a buffer to write into and the consumer always sees
+//the most recent complete frame, older unread frames are dropped
+triplebuffer_t *triplebuffer_new();
+void triplebuffer_publish(triplebuffer_t *triplebuffer,
+                          const uint64_t frame[DISPLAY_HEIGHT],
+                          uint32_t dirty_rows);
+const uint64_t *triplebuffer_acquire(triplebuffer_t *triplebuffer,
+                                     uint32_t *dirty_rows);
+void triplebuffer_get_stats(triplebuffer_t *triplebuffer,
+                            triplebuffer_stats_t *stats);
+void triplebuffer_free(triplebuffer_t *triplebuffer);
+
+//triplebuffer_acquire returns NULL when no frame was published since the
+//previous call. the returned frame stays valid until the next call.
+//dirty_rows passed to triplebuffer_publish are the rows changed since the
+//previous publish, the ones returned by triplebuffer_acquire are a superset
+//of the rows changed since the previous acquire, dropped frames included
@@ -0,0 +1,144 @@
+//work_deque.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "work_deque.h"
+
+//orderings follow Le, Pop, Cohen and Nardelli, "Correct and efficient
+//work-stealing for weak memory models", with a ring that does not grow and
+//a release store of bottom in push in place of the fence
+typedef struct work_deque {
+    _Atomic int64_t top;                //next item to steal
+    _Atomic int64_t bottom;             //next free slot, owner only writes
+    int64_t mask;
+    _Atomic(void *) *items;
+} work_deque_t;
+
+work_deque_t *work_deque_new(size_t capacity) {
+    if (capacity == 0 || capacity > (SIZE_MAX >> 2)) {
+        return NULL;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    work_deque_t *work_deque = malloc(sizeof(work_deque_t));
+    if (work_deque == NULL) {
+        return NULL;
+    }
+
+    work_deque->items = malloc(size * sizeof(work_deque->items[0]));
+    if (work_deque->items == NULL) {
+        free(work_deque);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&work_deque->items[i], NULL);
+    }
+    atomic_init(&work_deque->top, 0);
+    atomic_init(&work_deque->bottom, 0);
+    work_deque->mask = size - 1;
+
+    return work_deque;
+}
+
+int work_deque_push(work_deque_t *work_deque, void *item) {
+    if (work_deque == NULL) {
+        return -1;
+    }
+
+    int64_t bottom = atomic_load_explicit(&work_deque->bottom,
+                                          memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&work_deque->top,
+                                       memory_order_acquire);
+    if (bottom - top > work_deque->mask) {
+        return 1;
+    }
+
+    //publishes the item to thieves that read bottom
+    atomic_store_explicit(&work_deque->items[bottom & work_deque->mask],
+                          item, memory_order_relaxed);
+    atomic_store_explicit(&work_deque->bottom, bottom + 1,
+                          memory_order_release);
+
+    return 0;
+}
+
+void *work_deque_pop(work_deque_t *work_deque) {
+    if (work_deque == NULL) {
+        return NULL;
+    }
+
+    //claim the bottom slot first, then see whether a thief got there too
+    int64_t bottom = atomic_load_explicit(&work_deque->bottom,
+                                          memory_order_relaxed) - 1;
+    atomic_store_explicit(&work_deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&work_deque->top,
+                                       memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&work_deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return NULL;
+    }
+
+    void *item = atomic_load_explicit(
+        &work_deque->items[bottom & work_deque->mask], memory_order_relaxed);
+    if (top == bottom) {
+        //last item, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&work_deque->top, &top,
+                                                     top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+        {
+            item = NULL;
+        }
+        atomic_store_explicit(&work_deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+    }
+
+    return item;
+}
+
+void *work_deque_steal(work_deque_t *work_deque) {
+    if (work_deque == NULL) {
+        return NULL;
+    }
+
+    int64_t top = atomic_load_explicit(&work_deque->top,
+                                       memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&work_deque->bottom,
+                                          memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    void *item = atomic_load_explicit(
+        &work_deque->items[top & work_deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&work_deque->top, &top,
+                                                 top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        return NULL;
+    }
+
+    return item;
+}
+
+void work_deque_free(work_deque_t *work_deque) {
+    if (work_deque == NULL) {
+        return;
+    }
+
+    free(work_deque->items);
+    free(work_deque);
+}
@@ -0,0 +1,18 @@
+//work_deque.h
+
+#pragma once
+
+typedef struct work_deque work_deque_t;
+
+//Chase-Lev work stealing deque of pointers with a fixed capacity, rounded
+//up to a power of two. the owning thread pushes and pops at the bottom,
+//any other thread steals from the top
+work_deque_t *work_deque_new(size_t capacity);
+int work_deque_push(work_deque_t *work_deque, void *item);
+void *work_deque_pop(work_deque_t *work_deque);
+void *work_deque_steal(work_deque_t *work_deque);
+void work_deque_free(work_deque_t *work_deque);
+
+//work_deque_push returns 1 when the deque is full. work_deque_pop and
+//work_deque_steal return NULL when the deque is empty, and a steal also
+//when it lost a race for the last items, which then went to someone else